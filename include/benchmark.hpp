@@ -1,6 +1,7 @@
 #ifndef BENCHMARK_H
 #define BENCHMARK_H
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <thread>
@@ -10,33 +11,84 @@
 
 class Benchmark {
   public:
-  Benchmark(const size_t& thread_pool_size, const size_t& message_size, const size_t& message_count)
+  // Every `large_message_every`-th message is `large_message_size` bytes instead of
+  // `message_size`, when both are set.
+  Benchmark(const size_t& thread_pool_size,
+            const size_t& message_size,
+            const size_t& message_count,
+            const size_t& large_message_size = 0,
+            const size_t& large_message_every = 0)
       : thread_pool_size(thread_pool_size),
         message_size(message_size),
-        message_count(message_count) {
+        message_count(message_count),
+        large_message_size(large_message_size),
+        large_message_every(large_message_every) {
     this->threads.reserve(thread_pool_size);
   }
 
+  // Logs from every thread and shuts the logger down. The time includes writing out what is still
+  // queued, and the records that did not make it to the writers are reported next to it.
   void run() {
-    size_t log_size = message_size * message_count * thread_pool_size;
+    size_t large_count = large_message_every ? message_count / large_message_every : 0;
+    size_t log_size = (message_size * (message_count - large_count) +
+                       large_message_size * large_count) *
+                      thread_pool_size;
     auto start = std::chrono::high_resolution_clock::now();
     for (size_t i = 0; i < thread_pool_size; ++i) {
       threads.emplace_back([this]() {
         for (size_t j = 0; j < message_count; ++j) {
           // Log the message
-          LOG_INFO(std::string(message_size, 'a'));
+          if (large_message_every && (j + 1) % large_message_every == 0) {
+            LOG_INFO(std::string(large_message_size, 'b'));
+          } else {
+            LOG_INFO(std::string(message_size, 'a'));
+          }
         }
       });
     }
     for (auto& thread : threads) {
       thread.join();
     }
+    ShutdownReport report = Logger::getInstance().shutdown();
     auto end = std::chrono::high_resolution_clock::now();
-    std::cout << "Throughput: "
-              << (static_cast<double>(log_size) /
-                  (std::chrono::duration_cast<std::chrono::seconds>(end - start).count() * 1000 *
-                   1000))
-              << " MB/s" << std::endl;
+    std::chrono::duration<double> elapsed = end - start;
+    std::cout << "Throughput: " << (static_cast<double>(log_size) / (elapsed.count() * MB))
+              << " MB/s logged, " << (static_cast<double>(report.flushed) / elapsed.count())
+              << " records/s written" << std::endl;
+    std::cout << "Records: " << report.flushed << " written, " << report.dropped << " dropped, "
+              << report.abandoned << " abandoned" << std::endl;
+  }
+
+  // Durable mode: every thread waits for its record to be synced before logging the next one,
+  // and the time from logging to the ticket completing is reported as the commit latency.
+  void runDurable() {
+    std::vector<std::vector<double>> latencies(thread_pool_size);
+    for (size_t i = 0; i < thread_pool_size; ++i) {
+      threads.emplace_back([this, &latencies, i]() {
+        latencies[i].reserve(message_count);
+        for (size_t j = 0; j < message_count; ++j) {
+          auto start = std::chrono::steady_clock::now();
+          LOG_INFO(std::string(message_size, 'a'));
+          Logger::getInstance().commitTicket().wait();
+          std::chrono::duration<double, std::micro> latency =
+              std::chrono::steady_clock::now() - start;
+          latencies[i].push_back(latency.count());
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    std::vector<double> all;
+    for (const auto& thread_latencies : latencies) {
+      all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+    }
+    if (all.empty()) {
+      return;
+    }
+    std::sort(all.begin(), all.end());
+    std::cout << "Commit latency: p50 " << all[all.size() / 2] << " us, p99 "
+              << all[all.size() * 99 / 100] << " us, max " << all.back() << " us" << std::endl;
   }
 
   ~Benchmark() {}
@@ -45,6 +97,8 @@ class Benchmark {
   size_t thread_pool_size;
   size_t message_size;
   size_t message_count;
+  size_t large_message_size;
+  size_t large_message_every;
   std::vector<std::thread> threads;
 };
 
@@ -0,0 +1,131 @@
+#ifndef COMMIT_LOG_HPP
+#define COMMIT_LOG_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+// Durable mode of the sink. Records are made durable in groups: the sink writes and syncs
+// everything it consumed once `interval` has passed since the first pending record, or once
+// `max_batch` records are pending, whichever comes first.
+struct CommitOptions {
+  bool durable = false;
+  std::chrono::microseconds interval{2000};
+  size_t max_batch = 1024;
+};
+
+// Tracks how many records of a queue have been made durable. Records are identified by their
+// position in the queue, counted from 1, and committed in that order by the sink.
+class CommitLog {
+  public:
+  static constexpr uint64_t NONE = std::numeric_limits<uint64_t>::max();
+
+  explicit CommitLog(const CommitOptions& options = CommitOptions())
+      : options_(options), generation_(nextGeneration()) {}
+
+  CommitLog(const CommitLog&) = delete;
+  CommitLog& operator=(const CommitLog&) = delete;
+
+  const CommitOptions& options() const {
+    return options_;
+  }
+
+  // Tells apart the logs of successive sinks.
+  uint64_t generation() const {
+    return generation_;
+  }
+
+  // Marks the records up to `position` as processed, and as durable if `durable` is set. Once a
+  // sync has failed, nothing after it is reported durable. Does nothing once closed.
+  void commit(uint64_t position, bool durable) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (committed_ == NONE) {
+        return;
+      }
+      if (!durable && durable_up_to_ == NONE) {
+        durable_up_to_ = committed_;
+      }
+      committed_ = position;
+    }
+    committed_cv_.notify_all();
+  }
+
+  // Releases every waiter, records that were not committed yet never will be.
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (committed_ == NONE) {
+        return;
+      }
+      if (durable_up_to_ == NONE) {
+        durable_up_to_ = committed_;
+      }
+      committed_ = NONE;
+    }
+    committed_cv_.notify_all();
+  }
+
+  // Waits until the record at `position` has been processed and returns whether it is durable.
+  // Gives up and returns false at `deadline`.
+  template <typename Clock, typename Duration>
+  bool waitUntil(uint64_t position, const std::chrono::time_point<Clock, Duration>& deadline) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!committed_cv_.wait_until(
+            lock, deadline, [this, position]() { return committed_ >= position; })) {
+      return false;
+    }
+    return durable_up_to_ == NONE || position <= durable_up_to_;
+  }
+
+  bool wait(uint64_t position) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    committed_cv_.wait(lock, [this, position]() { return committed_ >= position; });
+    return durable_up_to_ == NONE || position <= durable_up_to_;
+  }
+
+  private:
+  static uint64_t nextGeneration() {
+    static std::atomic<uint64_t> next_generation{1};
+    return next_generation.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  const CommitOptions options_;
+  const uint64_t generation_;
+  std::mutex mutex_;
+  std::condition_variable committed_cv_;
+  uint64_t committed_ = 0;
+  // Set when a sync fails or the log is closed, records past it are not durable.
+  uint64_t durable_up_to_ = NONE;
+};
+
+// Completes once the records it covers have been synced to disk, see Logger::commitTicket().
+// A default constructed ticket stands for records that will never be durable.
+class CommitTicket {
+  public:
+  CommitTicket() = default;
+  CommitTicket(std::shared_ptr<CommitLog> log, uint64_t position)
+      : log_(std::move(log)), position_(position) {}
+
+  // Blocks until the records are synced and returns true, or returns false if they were dropped,
+  // abandoned at shutdown or a sync failed.
+  bool wait() const {
+    return log_ && log_->wait(position_);
+  }
+
+  // Like wait(), but also returns false once `timeout` has passed.
+  template <typename Rep, typename Period>
+  bool waitFor(const std::chrono::duration<Rep, Period>& timeout) const {
+    return log_ && log_->waitUntil(position_, std::chrono::steady_clock::now() + timeout);
+  }
+
+  private:
+  std::shared_ptr<CommitLog> log_;
+  uint64_t position_ = 0;
+};
+
+#endif  // COMMIT_LOG_HPP
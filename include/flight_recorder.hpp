@@ -0,0 +1,341 @@
+#ifndef FLIGHT_RECORDER_HPP
+#define FLIGHT_RECORDER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "message_stream.hpp"
+#include "record.hpp"
+
+namespace detail {
+
+template <typename T>
+constexpr bool deferrableArg() {
+  using U = std::remove_reference_t<T>;
+  if constexpr (std::is_array_v<U>) {
+    return std::is_same_v<std::remove_extent_t<U>, const char>;
+  } else {
+    return std::is_arithmetic_v<std::remove_cv_t<U>>;
+  }
+}
+
+// How an argument is kept unformatted: a string literal as a pointer, a number as it is.
+template <typename T>
+using StoredArg = std::conditional_t<std::is_array_v<std::remove_reference_t<T>>,
+                                     const char*,
+                                     std::remove_cv_t<std::remove_reference_t<T>>>;
+
+}  // namespace detail
+
+// Keeps the most recent records of every thread in memory instead of writing them, so the context
+// leading up to an error can be written once the error happens. Each thread owns a circular buffer
+// that overwrites its oldest record when full. Only the owning thread writes to it, claiming a
+// slot with one CAS; it only waits if a dump from another thread is moving that very slot. The
+// buffer of a thread that exits is freed, unless it still holds records for a dump of all threads,
+// in which case it is kept until that dump or until MAX_EXITED_THREADS newer ones are kept.
+//
+// A record of numbers and string literals only (see recordArgs()) keeps its arguments and is
+// formatted when it is dumped, otherwise the caller formats the message and it is copied into the
+// slot. The owning thread still reads the clock for every record.
+class FlightRecorder {
+  public:
+  static constexpr size_t DEFAULT_DEPTH = 256;
+  static constexpr size_t MAX_EXITED_THREADS = 64;
+  // Bytes of arguments a record can keep unformatted.
+  static constexpr size_t MAX_ARGS_SIZE = 64;
+
+  // Whether a record of these arguments can be kept unformatted: numbers, which are copied, and
+  // const char arrays, which are kept by pointer and so must be string literals like span names.
+  template <typename... Args>
+  static constexpr bool DEFERRABLE =
+      (detail::deferrableArg<Args>() && ...) &&
+      sizeof(std::tuple<detail::StoredArg<Args>...>) <= MAX_ARGS_SIZE;
+
+  // Starts recording up to `depth` records per thread.
+  void enable(size_t depth = DEFAULT_DEPTH) {
+    depth_.store(depth, std::memory_order_relaxed);
+  }
+
+  // Stops recording and forgets what was recorded.
+  void disable() {
+    depth_.store(0, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(registry_->mutex);
+    for (const auto& buffer : registry_->buffers) {
+      for (size_t i = 0; i < buffer->depth; ++i) {
+        Slot& slot = buffer->slots[i];
+        if (slot.beginTake()) {
+          slot.fields.clear();
+          slot.state.store(Slot::EMPTY, std::memory_order_release);
+        }
+      }
+    }
+    registry_->prune();
+  }
+
+  bool enabled() const {
+    return depth_.load(std::memory_order_relaxed) != 0;
+  }
+
+  // Stores a record with an already formatted message in the buffer of the calling thread. The
+  // slot's storage is reused.
+  void record(LogLevel level,
+              std::chrono::system_clock::time_point time,
+              std::string_view message,
+              std::vector<Field>&& fields) {
+    Slot* slot = beginWrite();
+    if (!slot) {
+      return;
+    }
+    slot->time = time;
+    slot->level = level;
+    slot->format = nullptr;
+    slot->message.assign(message.data(), message.size());
+    slot->fields = std::move(fields);
+    slot->state.store(Slot::FULL, std::memory_order_release);
+  }
+
+  // Stores a record whose message is `args` streamed in order, formatted when it is taken.
+  template <typename... Args>
+  void recordArgs(LogLevel level, std::chrono::system_clock::time_point time, Args&&... args) {
+    static_assert(DEFERRABLE<Args...>, "arguments must be numbers or string literals");
+    Slot* slot = beginWrite();
+    if (!slot) {
+      return;
+    }
+    slot->time = time;
+    slot->level = level;
+    slot->format = &formatArgs<detail::StoredArg<Args>...>;
+    new (slot->args) std::tuple<detail::StoredArg<Args>...>(args...);
+    slot->fields.clear();
+    slot->state.store(Slot::FULL, std::memory_order_release);
+  }
+
+  // Moves the records of the calling thread, or of every thread, out of the recorder, oldest
+  // first.
+  std::vector<LogRecord> take(bool all_threads) {
+    std::vector<Taken> taken;
+    if (!all_threads) {
+      local().takeInto(taken);
+    } else {
+      std::lock_guard<std::mutex> lock(registry_->mutex);
+      for (const auto& buffer : registry_->buffers) {
+        buffer->takeInto(taken);
+      }
+      registry_->prune();
+      std::stable_sort(taken.begin(), taken.end(), [](const Taken& a, const Taken& b) {
+        return a.record.time < b.record.time;
+      });
+    }
+    std::vector<LogRecord> records;
+    records.reserve(taken.size());
+    MessageStream stream;
+    for (Taken& t : taken) {
+      if (t.format) {
+        MessageStream::Scope scope(stream);
+        t.format(t.args, stream);
+        t.record.message.assign(stream.view().data(), stream.view().size());
+      }
+      records.push_back(std::move(t.record));
+    }
+    return records;
+  }
+
+  // Threads whose buffers are held, including exited ones that still hold records.
+  size_t threadCount() const {
+    std::lock_guard<std::mutex> lock(registry_->mutex);
+    return registry_->buffers.size();
+  }
+
+  private:
+  using FormatFn = void (*)(const unsigned char* args, std::ostream& out);
+
+  template <typename... Ts>
+  static void formatArgs(const unsigned char* args, std::ostream& out) {
+    const auto& values = *std::launder(reinterpret_cast<const std::tuple<Ts...>*>(args));
+    std::apply([&out](const auto&... value) { (out << ... << value); }, values);
+  }
+
+  struct Slot {
+    // The owning thread moves a slot from EMPTY or FULL to WRITING and on to FULL, a take moves
+    // it from FULL to TAKING and back to EMPTY.
+    enum State : uint8_t { EMPTY, WRITING, FULL, TAKING };
+    std::atomic<uint8_t> state{EMPTY};
+    uint64_t seq = 0;
+    std::chrono::system_clock::time_point time;
+    LogLevel level = LogLevel::DEBUG;
+    std::string message;
+    std::vector<Field> fields;
+    // Set if the message is still to be formatted from `args`.
+    FormatFn format = nullptr;
+    alignas(std::max_align_t) unsigned char args[MAX_ARGS_SIZE];
+
+    bool beginTake() {
+      uint8_t full = FULL;
+      return state.compare_exchange_strong(full, TAKING, std::memory_order_acquire);
+    }
+  };
+
+  // A record moved out of a slot, formatted once the slot has been given back.
+  struct Taken {
+    uint64_t seq;
+    LogRecord record;
+    FormatFn format;
+    alignas(std::max_align_t) unsigned char args[MAX_ARGS_SIZE];
+  };
+
+  struct ThreadBuffer {
+    // Only replaced by the owning thread, with the registry mutex held.
+    std::unique_ptr<Slot[]> slots;
+    size_t depth = 0;
+    // Used by the owning thread only.
+    size_t next = 0;  // Slot the next record goes to
+    uint64_t written = 0;
+    // Set once the owning thread has exited, guarded by the registry mutex.
+    bool exited = false;
+
+    // Called by the owning thread, or with the registry mutex held.
+    // Appends the records in the order they were written.
+    void takeInto(std::vector<Taken>& out) {
+      const size_t first = out.size();
+      for (size_t i = 0; i < depth; ++i) {
+        Slot& slot = slots[i];
+        if (!slot.beginTake()) {
+          continue;
+        }
+        Taken& t = out.emplace_back();
+        t.seq = slot.seq;
+        t.record.time = slot.time;
+        t.record.level = slot.level;
+        t.record.message = std::move(slot.message);
+        t.record.fields = std::move(slot.fields);
+        t.format = slot.format;
+        std::copy(std::begin(slot.args), std::end(slot.args), t.args);
+        slot.state.store(Slot::EMPTY, std::memory_order_release);
+      }
+      std::sort(out.begin() + first, out.end(), [](const Taken& a, const Taken& b) {
+        return a.seq < b.seq;
+      });
+    }
+
+    bool holdsRecords() const {
+      for (size_t i = 0; i < depth; ++i) {
+        if (slots[i].state.load(std::memory_order_acquire) == Slot::FULL) {
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+    // Frees the buffers of exited threads that hold nothing, and the oldest of those that do
+    // beyond MAX_EXITED_THREADS. The caller holds the mutex.
+    void prune() {
+      size_t kept = 0;
+      for (auto it = buffers.rbegin(); it != buffers.rend(); ++it) {
+        ThreadBuffer& buffer = **it;
+        if (!buffer.exited) {
+          continue;
+        }
+        if (!buffer.holdsRecords() || ++kept > MAX_EXITED_THREADS) {
+          it->reset();
+        }
+      }
+      buffers.erase(std::remove(buffers.begin(), buffers.end(), nullptr), buffers.end());
+    }
+  };
+
+  // The buffer of the calling thread. Marks it exited when the thread ends, or when the thread
+  // moves on to another recorder. Only holds a weak reference, so the recorder may go first.
+  struct LocalBuffer {
+    uint64_t owner = 0;
+    std::shared_ptr<ThreadBuffer> buffer;
+    std::weak_ptr<Registry> registry;
+
+    ~LocalBuffer() {
+      release();
+    }
+
+    void release() {
+      if (auto r = registry.lock()) {
+        std::lock_guard<std::mutex> lock(r->mutex);
+        buffer->exited = true;
+        r->prune();
+      }
+      buffer.reset();
+      registry.reset();
+    }
+  };
+
+  // Claims the slot for the next record of the calling thread, nullptr while disabled.
+  Slot* beginWrite() {
+    const size_t depth = depth_.load(std::memory_order_relaxed);
+    if (depth == 0) {
+      return nullptr;
+    }
+    ThreadBuffer& buffer = local();
+    if (buffer.depth != depth) {
+      // Forget what was recorded with the old depth.
+      auto slots = std::make_unique<Slot[]>(depth);
+      std::lock_guard<std::mutex> lock(registry_->mutex);
+      buffer.slots = std::move(slots);
+      buffer.depth = depth;
+      buffer.next = 0;
+    }
+    Slot& slot = buffer.slots[buffer.next];
+    buffer.next = (buffer.next + 1) % depth;
+    uint8_t state = slot.state.load(std::memory_order_relaxed);
+    while (state == Slot::TAKING ||
+           !slot.state.compare_exchange_weak(state, Slot::WRITING, std::memory_order_acquire)) {
+      if (state == Slot::TAKING) {
+        std::this_thread::yield();
+        state = slot.state.load(std::memory_order_relaxed);
+      }
+    }
+    slot.seq = buffer.written++;
+    return &slot;
+  }
+
+  ThreadBuffer& local() {
+    // The thread keeps its buffer alive, the registry lets other threads dump it.
+    thread_local LocalBuffer cached;
+    if (cached.owner != id_) {
+      cached.release();
+      auto buffer = std::make_shared<ThreadBuffer>();
+      {
+        std::lock_guard<std::mutex> lock(registry_->mutex);
+        registry_->buffers.push_back(buffer);
+      }
+      cached.owner = id_;
+      cached.buffer = std::move(buffer);
+      cached.registry = registry_;
+    }
+    return *cached.buffer;
+  }
+
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> next_id{1};
+    return next_id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Identifies this recorder in the thread local cache of the threads.
+  const uint64_t id_ = nextId();
+  std::atomic<size_t> depth_{0};
+  const std::shared_ptr<Registry> registry_ = std::make_shared<Registry>();
+};
+
+#endif  // FLIGHT_RECORDER_HPP
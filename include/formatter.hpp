@@ -0,0 +1,290 @@
+#ifndef FORMATTER_HPP
+#define FORMATTER_HPP
+
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "record.hpp"
+
+namespace detail {
+
+#if defined(__SSE2__)
+// Marks the bytes of a 16 byte block that need escaping.
+template <bool logfmt>
+inline __m128i escapeMask(const char* data) {
+  // Bytes at or below this value are control characters (or spaces for logfmt).
+  const __m128i limit = _mm_set1_epi8(logfmt ? ' ' : 0x1f);
+  const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+  __m128i mask = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                              _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  mask = _mm_or_si128(mask, _mm_cmpeq_epi8(_mm_max_epu8(v, limit), limit));
+  if (logfmt) {
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(v, _mm_set1_epi8('=')));
+  }
+  return mask;
+}
+#endif
+
+// Returns the index of the first byte that needs escaping, or `size` if there is none. With
+// `logfmt` set, spaces and '=' are reported too, since they force a logfmt value to be quoted.
+// Most values need no escaping at all, so 64 bytes are checked per branch.
+template <bool logfmt>
+inline size_t findEscape(const char* data, size_t size) {
+  size_t i = 0;
+#if defined(__SSE2__)
+  for (; i + 64 <= size; i += 64) {
+    const __m128i mask = _mm_or_si128(
+        _mm_or_si128(escapeMask<logfmt>(data + i), escapeMask<logfmt>(data + i + 16)),
+        _mm_or_si128(escapeMask<logfmt>(data + i + 32), escapeMask<logfmt>(data + i + 48)));
+    if (_mm_movemask_epi8(mask) != 0) {
+      break;
+    }
+  }
+  for (; i + 16 <= size; i += 16) {
+    const int bits = _mm_movemask_epi8(escapeMask<logfmt>(data + i));
+    if (bits != 0) {
+      return i + __builtin_ctz(bits);
+    }
+  }
+#endif
+  for (; i < size; ++i) {
+    const auto c = static_cast<unsigned char>(data[i]);
+    if (c == '"' || c == '\\' || c < 0x20 || (logfmt && (c == ' ' || c == '='))) {
+      return i;
+    }
+  }
+  return size;
+}
+
+// Appends `value` as the body of a JSON string, escaping quotes, backslashes and control bytes.
+inline void appendEscaped(std::string& out, std::string_view value) {
+  static constexpr char hex[] = "0123456789abcdef";
+  size_t pos = 0;
+  while (pos < value.size()) {
+    const size_t next = pos + findEscape<false>(value.data() + pos, value.size() - pos);
+    out.append(value.data() + pos, next - pos);
+    if (next == value.size()) {
+      break;
+    }
+    const auto c = static_cast<unsigned char>(value[next]);
+    switch (c) {
+      case '"':
+        out += "\\\"";
+        break;
+      case '\\':
+        out += "\\\\";
+        break;
+      case '\n':
+        out += "\\n";
+        break;
+      case '\r':
+        out += "\\r";
+        break;
+      case '\t':
+        out += "\\t";
+        break;
+      default:
+        out += "\\u00";
+        out += hex[c >> 4];
+        out += hex[c & 0xf];
+    }
+    pos = next + 1;
+  }
+}
+
+inline void appendJsonString(std::string& out, std::string_view value) {
+  out += '"';
+  appendEscaped(out, value);
+  out += '"';
+}
+
+// Logfmt values are written bare unless they are empty or contain spaces, '=' or bytes that need
+// escaping, in which case they are quoted with JSON escaping rules.
+inline void appendLogfmtString(std::string& out, std::string_view value) {
+  if (!value.empty() && findEscape<true>(value.data(), value.size()) == value.size()) {
+    out.append(value.data(), value.size());
+  } else {
+    appendJsonString(out, value);
+  }
+}
+
+template <typename T>
+inline void appendNumber(std::string& out, T value) {
+  char buf[32];
+  auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+  out.append(buf, end - buf);
+}
+
+// Appends a field value. Strings are escaped for the target format; non-finite doubles become
+// null in JSON since it has no spelling for them.
+inline void appendValue(std::string& out, const FieldValue& value, LogFormat format) {
+  if (const auto* s = std::get_if<std::string>(&value)) {
+    if (format == LogFormat::JSON) {
+      appendJsonString(out, *s);
+    } else {
+      appendLogfmtString(out, *s);
+    }
+  } else if (const auto* b = std::get_if<bool>(&value)) {
+    out += *b ? "true" : "false";
+  } else if (const auto* d = std::get_if<double>(&value)) {
+    if (format == LogFormat::JSON && !std::isfinite(*d)) {
+      out += "null";
+    } else {
+      appendNumber(out, *d);
+    }
+  } else if (const auto* i = std::get_if<int64_t>(&value)) {
+    appendNumber(out, *i);
+  } else {
+    appendNumber(out, std::get<uint64_t>(value));
+  }
+}
+
+// Formats the seconds part of a timestamp. The result is cached per thread since the sink renders
+// many records within the same second.
+inline void appendSeconds(std::string& out, std::time_t seconds, bool utc) {
+  thread_local std::time_t cached_seconds[2] = {-1, -1};
+  thread_local char cached[2][32];
+  thread_local size_t cached_size[2];
+  const int slot = utc ? 1 : 0;
+  if (cached_seconds[slot] != seconds) {
+    std::tm tm{};
+    if (utc) {
+      gmtime_r(&seconds, &tm);
+    } else {
+      localtime_r(&seconds, &tm);
+    }
+    const char* pattern = utc ? "%Y-%m-%dT%H:%M:%S" : "%Y-%m-%d %X";
+    cached_size[slot] = std::strftime(cached[slot], sizeof(cached[slot]), pattern, &tm);
+    cached_seconds[slot] = seconds;
+  }
+  out.append(cached[slot], cached_size[slot]);
+}
+
+// Appends an RFC 3339 UTC timestamp with millisecond precision.
+inline void appendUtcTime(std::string& out, std::chrono::system_clock::time_point time) {
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch());
+  appendSeconds(out, static_cast<std::time_t>(ms.count() / 1000), true);
+  const auto millis = static_cast<int>(ms.count() % 1000);
+  out += '.';
+  out += static_cast<char>('0' + millis / 100);
+  out += static_cast<char>('0' + millis / 10 % 10);
+  out += static_cast<char>('0' + millis % 10);
+  out += 'Z';
+}
+
+// "[2024-01-01 12:00:00][INFO] ", the part of the text format before the message.
+inline void appendTextHeader(const LogRecord& record, std::string& out) {
+  out += '[';
+  appendSeconds(out, std::chrono::system_clock::to_time_t(record.time), false);
+  out += "][";
+  out += levelToString(record.level);
+  out += "] ";
+}
+
+// " key=value" for every field of the record.
+inline void appendTextFields(const LogRecord& record, std::string& out) {
+  for (const auto& field : record.fields) {
+    out += ' ';
+    out += field.key.logfmt;
+    out += '=';
+    appendValue(out, field.value, LogFormat::LOGFMT);
+  }
+}
+
+}  // namespace detail
+
+// "message key=value", or "db.query duration_us=1234" for spans. The text format without the
+// time and the level.
+inline void formatMessage(const LogRecord& record, std::string& out) {
+  if (record.kind == RecordKind::SPAN) {
+    out += record.span_name;
+    out += " duration_us=";
+    detail::appendNumber(out, record.spanMicros());
+    return;
+  }
+  out += record.text();
+  detail::appendTextFields(record, out);
+}
+
+// "[2024-01-01 12:00:00][INFO] message key=value\n"
+// "[2024-01-01 12:00:00][INFO] db.query duration_us=1234\n" for spans
+inline void formatText(const LogRecord& record, std::string& out) {
+  detail::appendTextHeader(record, out);
+  formatMessage(record, out);
+  out += '\n';
+}
+
+// {"time":"2024-01-01T12:00:00.000Z","level":"INFO","message":"message","key":value}\n
+// {"time":"2024-01-01T12:00:00.000Z","level":"INFO","span":"db.query","duration_us":1234}\n
+inline void formatJson(const LogRecord& record, std::string& out) {
+  out += "{\"time\":\"";
+  detail::appendUtcTime(out, record.time);
+  out += "\",\"level\":\"";
+  out += levelToString(record.level);
+  if (record.kind == RecordKind::SPAN) {
+    out += "\",\"span\":";
+    detail::appendJsonString(out, record.span_name);
+    out += ",\"duration_us\":";
+    detail::appendNumber(out, record.spanMicros());
+    out += "}\n";
+    return;
+  }
+  out += "\",\"message\":";
+  detail::appendJsonString(out, record.text());
+  for (const auto& field : record.fields) {
+    out += ',';
+    out += field.key.json;
+    out += ':';
+    detail::appendValue(out, field.value, LogFormat::JSON);
+  }
+  out += "}\n";
+}
+
+// time=2024-01-01T12:00:00.000Z level=INFO msg="message" key=value\n
+// time=2024-01-01T12:00:00.000Z level=INFO span=db.query duration_us=1234\n
+inline void formatLogfmt(const LogRecord& record, std::string& out) {
+  out += "time=";
+  detail::appendUtcTime(out, record.time);
+  out += " level=";
+  out += levelToString(record.level);
+  if (record.kind == RecordKind::SPAN) {
+    out += " span=";
+    detail::appendLogfmtString(out, record.span_name);
+    out += " duration_us=";
+    detail::appendNumber(out, record.spanMicros());
+    out += '\n';
+    return;
+  }
+  out += " msg=";
+  detail::appendLogfmtString(out, record.text());
+  for (const auto& field : record.fields) {
+    out += ' ';
+    out += field.key.logfmt;
+    out += '=';
+    detail::appendValue(out, field.value, LogFormat::LOGFMT);
+  }
+  out += '\n';
+}
+
+inline void formatRecord(const LogRecord& record, LogFormat format, std::string& out) {
+  switch (format) {
+    case LogFormat::JSON:
+      formatJson(record, out);
+      break;
+    case LogFormat::LOGFMT:
+      formatLogfmt(record, out);
+      break;
+    default:
+      formatText(record, out);
+  }
+}
+
+#endif  // FORMATTER_HPP
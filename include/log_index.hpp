@@ -0,0 +1,489 @@
+#ifndef LOG_INDEX_HPP
+#define LOG_INDEX_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "record.hpp"
+
+// Sidecar index of a log file, written next to it as <file>.idx by FileWriter. The file is cut
+// into blocks of about `block_size` bytes at record boundaries, and every block gets an entry with
+// its offset, the range of its timestamps and the levels it contains. A query only reads the
+// blocks that can match.
+namespace logindex {
+
+constexpr char MAGIC[8] = {'L', 'O', 'G', 'I', 'N', 'D', 'E', 'X'};
+constexpr uint32_t VERSION = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+};
+
+struct Entry {
+  uint64_t offset;
+  uint64_t size;
+  int64_t min_time_ns;
+  int64_t max_time_ns;
+  uint32_t levels;  // Bit levelBit(level) is set for every level in the block
+  uint32_t records;
+};
+
+static_assert(sizeof(Header) == 16, "Index header layout changed");
+static_assert(sizeof(Entry) == 40, "Index entry layout changed");
+
+constexpr uint32_t ALL_LEVELS = 0xffffffff;
+
+inline uint32_t levelBit(LogLevel level) {
+  return 1u << static_cast<uint32_t>(level);
+}
+
+inline std::string indexPath(const std::string& log_path) {
+  return log_path + ".idx";
+}
+
+// A read-only memory mapping of a whole file.
+class MappedFile {
+  public:
+  explicit MappedFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open file: " + path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot stat file: " + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+      void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("Cannot map file: " + path);
+      }
+      data_ = static_cast<const char*>(data);
+      // Blocks are read front to back.
+      ::madvise(data, size_, MADV_SEQUENTIAL);
+    }
+    ::close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  const char* data() const {
+    return data_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// The entries of a mapped index file.
+class IndexReader {
+  public:
+  explicit IndexReader(const std::string& path) : file_(path) {
+    if (file_.size() < sizeof(Header)) {
+      throw std::runtime_error("Not an index file: " + path);
+    }
+    std::memcpy(&header_, file_.data(), sizeof(header_));
+    if (std::memcmp(header_.magic, MAGIC, sizeof(MAGIC)) != 0) {
+      throw std::runtime_error("Not an index file: " + path);
+    }
+    if (header_.version != VERSION) {
+      throw std::runtime_error("Unsupported index version " + std::to_string(header_.version));
+    }
+  }
+
+  uint32_t blockSize() const {
+    return header_.block_size;
+  }
+
+  // A torn last entry of an index that is still being written is not counted.
+  size_t size() const {
+    return (file_.size() - sizeof(Header)) / sizeof(Entry);
+  }
+
+  Entry entry(size_t i) const {
+    Entry entry;
+    std::memcpy(&entry, file_.data() + sizeof(Header) + i * sizeof(Entry), sizeof(entry));
+    return entry;
+  }
+
+  private:
+  MappedFile file_;
+  Header header_;
+};
+
+// Returns the position of the first occurrence of `needle` in `data`, or `size` if there is
+// none. Candidates are found 16 positions at a time by comparing the first, middle and last byte
+// of the needle, only those are compared in full.
+inline size_t findSubstring(const char* data, size_t size, std::string_view needle) {
+  const size_t n = needle.size();
+  if (n == 0) {
+    return 0;
+  }
+  if (n > size) {
+    return size;
+  }
+  size_t i = 0;
+#if defined(__SSE2__)
+  const size_t middle = n / 2;
+  const __m128i first = _mm_set1_epi8(needle.front());
+  const __m128i mid = _mm_set1_epi8(needle[middle]);
+  const __m128i last = _mm_set1_epi8(needle.back());
+  for (; i + n - 1 + 16 <= size; i += 16) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + middle));
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + n - 1));
+    unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, mid)), _mm_cmpeq_epi8(c, last))));
+    while (mask != 0) {
+      const size_t pos = i + __builtin_ctz(mask);
+      if (std::memcmp(data + pos, needle.data(), n) == 0) {
+        return pos;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i + n <= size; ++i) {
+    if (data[i] == needle.front() && std::memcmp(data + i, needle.data(), n) == 0) {
+      return i;
+    }
+  }
+  return size;
+}
+
+// Parses "YYYY-MM-DD HH:MM:SS" as local time, the text format, or "YYYY-MM-DDTHH:MM:SS" as UTC,
+// the JSON and logfmt format. Returns false if `s` does not start with either.
+inline bool parseTime(std::string_view s, int64_t& seconds) {
+  if (s.size() < 19 || s[4] != '-' || s[7] != '-' || s[13] != ':' || s[16] != ':' ||
+      (s[10] != ' ' && s[10] != 'T')) {
+    return false;
+  }
+  auto number = [&s](size_t pos, size_t len, int& value) {
+    value = 0;
+    for (size_t i = pos; i < pos + len; ++i) {
+      if (s[i] < '0' || s[i] > '9') {
+        return false;
+      }
+      value = value * 10 + (s[i] - '0');
+    }
+    return true;
+  };
+  int year, month, day, hour, minute, second;
+  if (!number(0, 4, year) || !number(5, 2, month) || !number(8, 2, day) ||
+      !number(11, 2, hour) || !number(14, 2, minute) || !number(17, 2, second)) {
+    return false;
+  }
+  std::tm tm{};
+  tm.tm_year = year - 1900;
+  tm.tm_mon = month - 1;
+  tm.tm_mday = day;
+  tm.tm_hour = hour;
+  tm.tm_min = minute;
+  tm.tm_sec = second;
+  tm.tm_isdst = -1;
+  seconds = static_cast<int64_t>(s[10] == 'T' ? timegm(&tm) : std::mktime(&tm));
+  return true;
+}
+
+// Finds the timestamp of a line in any of the log formats.
+inline bool parseLineTime(std::string_view line, int64_t& seconds) {
+  for (std::string_view prefix : {"[", "{\"time\":\"", "time="}) {
+    if (line.substr(0, prefix.size()) == prefix) {
+      return parseTime(line.substr(prefix.size()), seconds);
+    }
+  }
+  return false;
+}
+
+// Finds the level of a line in any of the log formats.
+inline bool parseLineLevel(std::string_view line, LogLevel& level) {
+  line = line.substr(0, 64);
+  for (std::string_view marker : {"][", "\"level\":\"", " level="}) {
+    const size_t pos = line.find(marker);
+    if (pos == std::string_view::npos) {
+      continue;
+    }
+    const std::string_view rest = line.substr(pos + marker.size());
+    for (auto candidate : {LogLevel::DEBUG, LogLevel::INFO, LogLevel::WARNING, LogLevel::ERROR,
+                           LogLevel::CRITICAL}) {
+      const std::string_view name = levelToString(candidate);
+      if (rest.substr(0, name.size()) == name && rest.size() > name.size() &&
+          (rest[name.size()] == ']' || rest[name.size()] == '"' || rest[name.size()] == ' ')) {
+        level = candidate;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Collects the entries while the log is written. Offsets are those of the log file.
+class IndexBuilder {
+  public:
+  // `existing` is what the log already holds, e.g. when it is appended to. Entries of an index
+  // already at `path` are kept as far as they match it, the rest of it is indexed from its lines.
+  // Entries past its end are dropped, as are those of an index built with another block size.
+  IndexBuilder(const std::string& path, uint32_t block_size, std::string_view existing = {})
+      : block_size_(block_size) {
+    if (block_size == 0) {
+      throw std::invalid_argument("Index block size must be greater than 0");
+    }
+    const std::vector<Entry> kept = readEntries(path, block_size, existing.size());
+    file_.open(path, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file_.is_open()) {
+      throw std::runtime_error("Cannot open index file: " + path);
+    }
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.block_size = block_size;
+    file_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t indexed_end = 0;
+    for (const Entry& entry : kept) {
+      file_.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+      indexed_end = entry.offset + entry.size;
+    }
+    addLines(existing, indexed_end);
+  }
+
+  ~IndexBuilder() {
+    finish();
+  }
+
+  // Adds a record of `size` bytes written at `offset`.
+  void add(uint64_t offset, uint64_t size, std::chrono::system_clock::time_point time,
+           LogLevel level) {
+    const int64_t time_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    add(offset, size, time_ns, time_ns, levelBit(level));
+  }
+
+  // Hands the entries written so far to the OS. The open block stays open.
+  void flush() {
+    file_.flush();
+  }
+
+  // Writes the open block and closes the index.
+  void finish() {
+    if (file_.is_open()) {
+      if (block_.records > 0) {
+        writeBlock();
+      }
+      file_.close();
+    }
+  }
+
+  private:
+  // The entries of the index at `path` that cover the first `log_size` bytes of the log without
+  // gaps, none if it is missing or was built with another block size.
+  static std::vector<Entry> readEntries(const std::string& path,
+                                        uint32_t block_size,
+                                        uint64_t log_size) {
+    std::vector<Entry> entries;
+    std::ifstream in(path, std::ios::in | std::ios::binary);
+    Header header{};
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION ||
+        header.block_size != block_size) {
+      return entries;
+    }
+    uint64_t end = 0;
+    Entry entry;
+    while (in.read(reinterpret_cast<char*>(&entry), sizeof(entry)) && entry.offset == end &&
+           entry.size <= log_size - end) {
+      entries.push_back(entry);
+      end += entry.size;
+    }
+    return entries;
+  }
+
+  // Indexes the lines of `log` from `offset` on. A line whose time or level cannot be read makes
+  // its block match every query.
+  void addLines(std::string_view log, uint64_t offset) {
+    while (offset < log.size()) {
+      const size_t newline = log.find('\n', offset);
+      const uint64_t end = newline == std::string_view::npos ? log.size() : newline + 1;
+      const std::string_view line = log.substr(offset, end - offset);
+      int64_t seconds = 0;
+      LogLevel level = LogLevel::INFO;
+      if (parseLineTime(line, seconds) && parseLineLevel(line, level)) {
+        // Lines carry whole seconds.
+        add(offset, end - offset, seconds * 1000000000, seconds * 1000000000 + 999999999,
+            levelBit(level));
+      } else {
+        add(offset, end - offset, std::numeric_limits<int64_t>::min(),
+            std::numeric_limits<int64_t>::max(), ALL_LEVELS);
+      }
+      offset = end;
+    }
+  }
+
+  void add(uint64_t offset, uint64_t size, int64_t min_time_ns, int64_t max_time_ns,
+           uint32_t levels) {
+    if (block_.records > 0 && offset - block_.offset >= block_size_) {
+      writeBlock();
+    }
+    if (block_.records == 0) {
+      block_ = Entry{offset, 0, min_time_ns, max_time_ns, 0, 0};
+    }
+    block_.size = offset + size - block_.offset;
+    block_.min_time_ns = std::min(block_.min_time_ns, min_time_ns);
+    block_.max_time_ns = std::max(block_.max_time_ns, max_time_ns);
+    block_.levels |= levels;
+    ++block_.records;
+  }
+
+  void writeBlock() {
+    file_.write(reinterpret_cast<const char*>(&block_), sizeof(block_));
+    block_ = Entry{};
+  }
+
+  std::ofstream file_;
+  const uint32_t block_size_;
+  Entry block_{};
+};
+
+struct Query {
+  int64_t from_ns = std::numeric_limits<int64_t>::min();
+  int64_t to_ns = std::numeric_limits<int64_t>::max();
+  uint32_t levels = ALL_LEVELS;
+  std::string needle;
+};
+
+struct QueryStats {
+  size_t blocks = 0;
+  size_t blocks_scanned = 0;
+  size_t bytes_scanned = 0;
+  size_t lines = 0;
+};
+
+namespace detail {
+
+// Hands the lines of data[begin, end) that match `query` to `emit`. Only what a block's entry
+// does not already settle is checked per line.
+template <typename F>
+void scan(const char* data, size_t begin, size_t end, const Query& query, bool check_time,
+          bool check_level, QueryStats& stats, F& emit) {
+  stats.bytes_scanned += end - begin;
+  auto matches = [&](std::string_view line) {
+    if (check_level) {
+      LogLevel level;
+      if (!parseLineLevel(line, level) || (query.levels & levelBit(level)) == 0) {
+        return false;
+      }
+    }
+    if (check_time) {
+      // Lines carry whole seconds, keep those that overlap the range.
+      int64_t seconds;
+      if (!parseLineTime(line, seconds)) {
+        return false;
+      }
+      const int64_t ns = seconds * 1000000000;
+      if (ns + 999999999 < query.from_ns || ns > query.to_ns) {
+        return false;
+      }
+    }
+    return true;
+  };
+  size_t pos = begin;
+  while (pos < end) {
+    size_t line_begin = pos;
+    if (!query.needle.empty()) {
+      const size_t hit = pos + findSubstring(data + pos, end - pos, query.needle);
+      if (hit >= end) {
+        return;
+      }
+      line_begin = hit;
+      while (line_begin > pos && data[line_begin - 1] != '\n') {
+        --line_begin;
+      }
+      pos = hit;
+    }
+    const void* newline = std::memchr(data + pos, '\n', end - pos);
+    const size_t line_end =
+        newline != nullptr ? static_cast<const char*>(newline) - data + 1 : end;
+    std::string_view line(data + line_begin, line_end - line_begin);
+    if (matches(line)) {
+      ++stats.lines;
+      emit(line);
+    }
+    pos = line_end;
+  }
+}
+
+}  // namespace detail
+
+// Runs `query` over the mapped log `data` and hands every matching line, with its newline, to
+// `emit`. Without an index the whole file is scanned. Bytes past the last indexed block, e.g. of
+// a log that is still being written, are scanned too.
+template <typename F>
+QueryStats query(const char* data, size_t size, const IndexReader* index, const Query& query,
+                 F&& emit) {
+  QueryStats stats;
+  size_t indexed_end = 0;
+  if (index != nullptr) {
+    stats.blocks = index->size();
+    for (size_t i = 0; i < index->size(); ++i) {
+      const Entry entry = index->entry(i);
+      if (entry.offset + entry.size > size) {
+        break;
+      }
+      indexed_end = entry.offset + entry.size;
+      if (entry.max_time_ns < query.from_ns || entry.min_time_ns > query.to_ns ||
+          (entry.levels & query.levels) == 0) {
+        continue;
+      }
+      ++stats.blocks_scanned;
+      const bool check_time = entry.min_time_ns < query.from_ns || entry.max_time_ns > query.to_ns;
+      const bool check_level = (entry.levels & ~query.levels) != 0;
+      detail::scan(data, entry.offset, indexed_end, query, check_time, check_level, stats, emit);
+    }
+  }
+  if (indexed_end < size) {
+    const bool check_time = query.from_ns != std::numeric_limits<int64_t>::min() ||
+                            query.to_ns != std::numeric_limits<int64_t>::max();
+    detail::scan(
+        data, indexed_end, size, query, check_time, query.levels != ALL_LEVELS, stats, emit);
+  }
+  return stats;
+}
+
+}  // namespace logindex
+
+#endif  // LOG_INDEX_HPP
@@ -1,17 +1,27 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <atomic>
+#include <chrono>
 #include <ctime>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "commit_log.hpp"
+#include "flight_recorder.hpp"
+#include "message_pool.hpp"
+#include "message_stream.hpp"
+#include "record.hpp"
 #include "ring_buffer.hpp"
+#include "shm_ring_buffer.hpp"
 #include "sink.hpp"
 
 #define LOG_INFO(...) Logger::getInstance().info(__VA_ARGS__)
@@ -20,7 +30,22 @@
 #define LOG_ERROR(...) Logger::getInstance().error(__VA_ARGS__)
 #define LOG_CRITICAL(...) Logger::getInstance().critical(__VA_ARGS__)
 
-enum class LogLevel : uint8_t { DEBUG = 1, INFO, WARNING, ERROR, CRITICAL };
+// Settings of Logger::init() beyond the file, level and console output.
+struct LoggerOptions {
+  LogFormat format = LogFormat::TEXT;
+  // Spans are written here as Chrome trace events if it is set, and logged with their duration
+  // otherwise.
+  std::string traceFilename;
+  // With `commit.durable` set, the writers are synced in groups and Logger::commitTicket() tells
+  // when a record has reached the disk.
+  CommitOptions commit;
+  // If set, the log file gets a sidecar index for logquery with an entry about every
+  // `indexBlockSize` bytes.
+  size_t indexBlockSize = 0;
+  // If set (unix:<path> or udp:<host>:<port>), records are also sent there as RFC 5424 syslog
+  // datagrams.
+  std::string datagramAddress;
+};
 
 class Logger {
   public:
@@ -35,48 +60,84 @@ class Logger {
   Logger(const Logger&) = delete;
   Logger& operator=(const Logger&) = delete;
 
-  // Initialize logger with configuration
+  // Initialize logger with configuration, see LoggerOptions for the rest of it. Calling it again
+  // reconfigures the logger: new records go to a fresh queue right away, while the records
+  // already queued are written out by the old writers before the new ones start. If a writer
+  // cannot be opened, it throws and the logger keeps its current configuration.
   void init(const std::string& filename = "",
             LogLevel level = LogLevel::INFO,
             bool consoleOutput = true,
-            bool override = false);
+            const LoggerOptions& options = LoggerOptions());
+
+  // Sends records to the shared memory segment `name` instead of writing them from this process.
+  // A logcollector process attached to the same segment formats and writes them. The segment is
+  // created if it does not exist yet.
+  void initShared(const std::string& name, LogLevel level = LogLevel::INFO);
+
+  // Logging methods. Field arguments (see LOG_FIELD) are attached to the record, everything else
+  // is streamed into the message.
+  template <typename... Args>
+  void log(LogLevel level, Args&&... args) {
+    if (level < minCaptureLevel.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if constexpr (FlightRecorder::DEFERRABLE<Args...>) {
+      // Only kept by the flight recorder, which formats it if it is ever dumped.
+      if (level < minLogLevel.load(std::memory_order_relaxed)) {
+        flightRecorder.recordArgs(level, std::chrono::system_clock::now(), args...);
+        return;
+      }
+    }
+    // Messages are built in a per-thread stream so its storage is reused. A log call made while
+    // streaming the arguments of another one gets a stream of its own.
+    MessageStream& cached = threadStream();
+    if (cached.busy()) {
+      MessageStream stream;
+      log(stream, level, std::forward<Args>(args)...);
+    } else {
+      log(cached, level, std::forward<Args>(args)...);
+    }
+  }
 
-  // Logging methods
   template <typename... Args>
   void debug(Args&&... args) {
-    std::stringstream ss;
-    // Fold the args into a stringstream
-    (ss << ... << std::forward<Args>(args));
-    _debug(ss.str());
+    log(LogLevel::DEBUG, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void info(Args&&... args) {
-    std::stringstream ss;
-    (ss << ... << std::forward<Args>(args));
-    _info(ss.str());
+    log(LogLevel::INFO, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void warning(Args&&... args) {
-    std::stringstream ss;
-    (ss << ... << std::forward<Args>(args));
-    _warning(ss.str());
+    log(LogLevel::WARNING, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void error(Args&&... args) {
-    std::stringstream ss;
-    (ss << ... << std::forward<Args>(args));
-    _error(ss.str());
+    log(LogLevel::ERROR, std::forward<Args>(args)...);
   }
 
   template <typename... Args>
   void critical(Args&&... args) {
-    std::stringstream ss;
-    (ss << ... << std::forward<Args>(args));
-    _critical(ss.str());
+    log(LogLevel::CRITICAL, std::forward<Args>(args)...);
   }
+  // Records a span that ran from `begin` to `end`. Only a view of the name is queued, so it must
+  // be a string literal.
+  template <size_t N>
+  void span(const char (&name)[N],
+            LogLevel level,
+            std::chrono::system_clock::time_point begin,
+            std::chrono::system_clock::time_point end) {
+    _span(std::string_view(name, N - 1), level, begin, end);
+  }
+
+  // Whether records of this level are currently logged.
+  bool enabled(LogLevel level) const {
+    return level >= minLogLevel.load(std::memory_order_relaxed);
+  }
+
   void _debug(const std::string& message);
   void _info(const std::string& message);
   void _warning(const std::string& message);
@@ -86,25 +147,154 @@ class Logger {
   // Set minimum log level
   void setLogLevel(LogLevel level);
 
+  // Returns a ticket that completes once every record this thread has queued so far is synced,
+  // e.g. LOG_INFO("transfer ", id); Logger::getInstance().commitTicket().wait(). Requires durable
+  // mode, see init().
+  CommitTicket commitTicket();
+
+  // Keeps the last `depth` records of each thread from `level` up to the log level in memory
+  // instead of dropping them. They are written, oldest first, right before the next ERROR or
+  // CRITICAL record of the same thread, or of every thread if `dumpAllThreads` is set. A call
+  // of numbers and string literals only is kept unformatted and costs about a clock read more
+  // than a dropped one, any other call is formatted and copied as if it were logged. const char
+  // arrays are kept by pointer, so they must outlive the dump as string literals do.
+  void enableFlightRecorder(LogLevel level = LogLevel::DEBUG,
+                            size_t depth = FlightRecorder::DEFAULT_DEPTH,
+                            bool dumpAllThreads = false);
+  void disableFlightRecorder();
+
+  // Writes what the flight recorder holds now, e.g. from a signal or watchdog handler thread.
+  void dumpFlightRecorder(bool allThreads = true);
+
+  // Stops accepting records and drains the queue, giving up on whatever is left once `timeout`
+  // has passed. Logging afterwards is a no-op until init() is called again.
+  ShutdownReport shutdown(std::chrono::milliseconds timeout = std::chrono::milliseconds::max());
+
   // Notify the sink to finish.
   void finish();
 
   private:
+  friend class ScopeTimer;
+
   Logger();  // Private constructor
   ~Logger();
 
-  // Core logging function
-  void _log(LogLevel level, const std::string& message);
-  // Helper functions
-  std::string getCurrentTime();
-  std::string levelToString(LogLevel level);
-  std::string formatMessage(LogLevel level, const std::string& message);
+  // `name` must have static storage, see span().
+  void _span(std::string_view name,
+             LogLevel level,
+             std::chrono::system_clock::time_point begin,
+             std::chrono::system_clock::time_point end);
+
+  // Core logging function. If `message` is the content of `source`, a large message takes over
+  // the stream's storage instead of being copied.
+  void _log(LogLevel level,
+            std::string_view message,
+            std::vector<Field> fields = {},
+            MessageStream* source = nullptr);
+
+  // Queues a record, the caller holds pipelineMutex shared.
+  void produce(LogLevel level,
+               std::chrono::system_clock::time_point time,
+               std::string_view message,
+               std::vector<Field>&& fields,
+               MessageStream* source = nullptr);
+
+  void dumpFlightRecorderLocked(bool allThreads);
+
+  void updateCaptureLevel();
+
+  // The stream messages of the calling thread are built in, shared by every log() signature.
+  static MessageStream& threadStream();
+
+  bool produceShared(LogLevel level,
+                     std::chrono::system_clock::time_point time,
+                     std::string_view message,
+                     const std::vector<Field>& fields);
 
-  LogLevel minLogLevel;
+  template <typename... Args>
+  void log(MessageStream& stream, LogLevel level, Args&&... args) {
+    MessageStream::Scope scope(stream);
+    std::vector<Field> fields;
+    // Fold the args into the stream
+    (append(stream, fields, std::forward<Args>(args)), ...);
+    _log(level, stream.view(), std::move(fields), &stream);
+  }
+
+  template <typename T>
+  static void append(std::ostream& ss, std::vector<Field>& fields, T&& arg) {
+    if constexpr (std::is_same_v<std::decay_t<T>, Field>) {
+      fields.push_back(std::forward<T>(arg));
+    } else {
+      ss << std::forward<T>(arg);
+    }
+  }
+
+  std::atomic<LogLevel> minLogLevel;
   bool consoleOutput;
 
-  std::shared_ptr<RingBuffer<std::string>> buffer;
+  // Lowest level that is either logged or kept by the flight recorder, so a call below it costs
+  // one load.
+  std::atomic<LogLevel> minCaptureLevel;
+  std::atomic<LogLevel> flightRecorderLevel;
+  std::atomic<bool> flightRecorderAllThreads;
+  FlightRecorder flightRecorder;
+
+  // Holds messages above the large message threshold while they are in flight.
+  std::shared_ptr<MessagePool> messagePool;
+
+  // Producers hold pipelineMutex shared while pushing, init() and shutdown() take it exclusively
+  // to swap the buffer. Once swapped out, nothing can be pushed to the old buffer any more.
+  std::shared_mutex pipelineMutex;
+  std::shared_ptr<RingBuffer<LogRecord>> buffer;
+  // Set along with buffer in durable mode.
+  std::shared_ptr<CommitLog> commitLog;
+  // Set instead of buffer after initShared().
+  std::unique_ptr<shm::Producer> shared;
+  std::atomic<size_t> dropped;
+
+  // Serializes init() and shutdown().
+  std::mutex lifecycleMutex;
   std::unique_ptr<Sink> sink;
 };
 
+// Records the time between its construction and destruction (or stop()) as a span. The name must
+// be a string literal.
+class ScopeTimer {
+  public:
+  template <size_t N>
+  explicit ScopeTimer(const char (&name)[N], LogLevel level = LogLevel::INFO)
+      : name_(name, N - 1), level_(level), running_(Logger::getInstance().enabled(level)) {
+    if (running_) {
+      begin_ = std::chrono::system_clock::now();
+    }
+  }
+
+  ScopeTimer(const ScopeTimer&) = delete;
+  ScopeTimer& operator=(const ScopeTimer&) = delete;
+
+  ~ScopeTimer() {
+    stop();
+  }
+
+  // Ends the span early. Further calls do nothing.
+  void stop() {
+    if (running_) {
+      running_ = false;
+      Logger::getInstance()._span(name_, level_, begin_, std::chrono::system_clock::now());
+    }
+  }
+
+  private:
+  std::string_view name_;
+  LogLevel level_;
+  bool running_;
+  std::chrono::system_clock::time_point begin_;
+};
+
+#define LOG_CONCAT_INNER(a, b) a##b
+#define LOG_CONCAT(a, b) LOG_CONCAT_INNER(a, b)
+// Times the rest of the enclosing scope, e.g. LOG_SCOPE_TIMER("db.query"). The name must be a
+// string literal.
+#define LOG_SCOPE_TIMER(...) ScopeTimer LOG_CONCAT(log_scope_timer_, __LINE__)(__VA_ARGS__)
+
 #endif  // LOGGER_H
\ No newline at end of file
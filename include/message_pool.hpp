@@ -0,0 +1,145 @@
+#ifndef MESSAGE_POOL_HPP
+#define MESSAGE_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Storage for messages that are too large to be kept in a ring buffer slot. A record only holds a
+// handle to the pooled buffer, which returns to the pool once the sink has written the record.
+// The pool bounds the bytes held by in-flight large messages, so a burst of stack dumps cannot grow
+// the process without limit, and it keeps a few warm buffers of at most max_free_capacity bytes
+// around to avoid mapping fresh pages for every copied message.
+class MessagePool : public std::enable_shared_from_this<MessagePool> {
+  public:
+  static constexpr size_t DEFAULT_THRESHOLD = 64 * 1024;
+  static constexpr size_t DEFAULT_MAX_BYTES = 64 * 1024 * 1024;
+  static constexpr size_t DEFAULT_MAX_FREE = 4;
+  static constexpr size_t DEFAULT_MAX_FREE_CAPACITY = 1024 * 1024;
+
+  using Handle = std::shared_ptr<const std::string>;
+
+  static std::shared_ptr<MessagePool> create(size_t threshold = DEFAULT_THRESHOLD,
+                                             size_t max_bytes = DEFAULT_MAX_BYTES,
+                                             size_t max_free = DEFAULT_MAX_FREE,
+                                             size_t max_free_capacity = DEFAULT_MAX_FREE_CAPACITY) {
+    return std::shared_ptr<MessagePool>(
+        new MessagePool(threshold, max_bytes, max_free, max_free_capacity));
+  }
+
+  MessagePool(const MessagePool&) = delete;
+  MessagePool& operator=(const MessagePool&) = delete;
+
+  ~MessagePool() {
+    for (auto* buffer : free_) {
+      delete buffer;
+    }
+  }
+
+  // Messages of at least this size should go through the pool.
+  size_t threshold() const {
+    return threshold_;
+  }
+
+  // Returns a handle owning a copy of the message, or nullptr if the pool is out of budget and the
+  // message has to be dropped. A free buffer is reused when one is large enough.
+  Handle acquire(std::string_view message) {
+    std::string* buffer = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (in_use_bytes_ + message.size() > max_bytes_) {
+        return nullptr;
+      }
+      in_use_bytes_ += message.size();
+      for (size_t i = 0; i < free_.size(); ++i) {
+        if (free_[i]->capacity() >= message.size()) {
+          buffer = free_[i];
+          free_[i] = free_.back();
+          free_.pop_back();
+          break;
+        }
+      }
+    }
+    if (buffer != nullptr) {
+      buffer->assign(message);
+    } else {
+      buffer = new std::string(message);
+    }
+    return wrap(buffer, true);
+  }
+
+  // Like acquire(std::string_view), but takes over the storage of `message` instead of copying
+  // it. `message` is left untouched if the pool is out of budget. The storage is freed with the
+  // handle rather than kept for reuse, its size is up to whoever built the message.
+  Handle acquire(std::string&& message) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (in_use_bytes_ + message.size() > max_bytes_) {
+        return nullptr;
+      }
+      in_use_bytes_ += message.size();
+    }
+    return wrap(new std::string(std::move(message)), false);
+  }
+
+  // Bytes currently held by in-flight messages.
+  size_t inUseBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_use_bytes_;
+  }
+
+  size_t freeBuffers() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_.size();
+  }
+
+  private:
+  MessagePool(size_t threshold, size_t max_bytes, size_t max_free, size_t max_free_capacity)
+      : threshold_(threshold),
+        max_bytes_(max_bytes),
+        max_free_(max_free),
+        max_free_capacity_(max_free_capacity) {
+    free_.reserve(max_free);
+  }
+
+  // With `reuse` set, the buffer may go to the free list once the handle is gone.
+  Handle wrap(std::string* buffer, bool reuse) {
+    const size_t size = buffer->size();
+    // The deleter only holds a weak reference, so handles may outlive the pool.
+    std::weak_ptr<MessagePool> pool = weak_from_this();
+    return Handle(buffer, [pool, size, reuse](const std::string* buffer) {
+      if (auto self = pool.lock()) {
+        self->release(const_cast<std::string*>(buffer), size, reuse);
+      } else {
+        delete buffer;
+      }
+    });
+  }
+
+  void release(std::string* buffer, size_t size, bool reuse) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      in_use_bytes_ -= size;
+      if (reuse && free_.size() < max_free_ && buffer->capacity() <= max_free_capacity_) {
+        buffer->clear();
+        free_.push_back(buffer);
+        return;
+      }
+    }
+    delete buffer;
+  }
+
+  const size_t threshold_;
+  const size_t max_bytes_;
+  const size_t max_free_;
+  const size_t max_free_capacity_;
+  mutable std::mutex mutex_;
+  size_t in_use_bytes_ = 0;
+  std::vector<std::string*> free_;
+};
+
+#endif  // MESSAGE_POOL_HPP
@@ -0,0 +1,84 @@
+#ifndef MESSAGE_STREAM_HPP
+#define MESSAGE_STREAM_HPP
+
+#include <cstddef>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// An output stream over a std::string that can be viewed without copying and reset without
+// giving up its storage, so a thread can build all of its messages in the same memory.
+class MessageStream : public std::ostream {
+  public:
+  // Storage kept between messages. A larger one is given back once its message is done, so an
+  // occasional large message does not stay allocated for the life of the thread.
+  static constexpr size_t MAX_CAPACITY = 4 * 1024;
+
+  MessageStream() : std::ostream(&buffer_) {}
+
+  MessageStream(const MessageStream&) = delete;
+  MessageStream& operator=(const MessageStream&) = delete;
+
+  std::string_view view() const {
+    return buffer_.data;
+  }
+
+  // Hands over the storage of the current message, e.g. to park a large one in a MessagePool.
+  // The stream continues with an empty string.
+  std::string release() {
+    return std::exchange(buffer_.data, std::string());
+  }
+
+  bool busy() const {
+    return busy_;
+  }
+
+  // Marks the stream as in use and starts a new message with default formatting.
+  class Scope {
+    public:
+    explicit Scope(MessageStream& stream) : stream_(stream) {
+      stream_.busy_ = true;
+      stream_.buffer_.data.clear();
+      stream_.clear();
+      stream_.flags(std::ios_base::dec | std::ios_base::skipws);
+      stream_.precision(6);
+      stream_.width(0);
+      stream_.fill(' ');
+    }
+    ~Scope() {
+      if (stream_.buffer_.data.capacity() > MAX_CAPACITY) {
+        std::string().swap(stream_.buffer_.data);
+      }
+      stream_.busy_ = false;
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    private:
+    MessageStream& stream_;
+  };
+
+  private:
+  struct Buffer : public std::streambuf {
+    int_type overflow(int_type ch) override {
+      if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+        data.push_back(traits_type::to_char_type(ch));
+      }
+      return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+      data.append(s, static_cast<size_t>(n));
+      return n;
+    }
+
+    std::string data;
+  };
+
+  Buffer buffer_;
+  bool busy_ = false;
+};
+
+#endif  // MESSAGE_STREAM_HPP
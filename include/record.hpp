@@ -0,0 +1,207 @@
+#ifndef RECORD_HPP
+#define RECORD_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "message_pool.hpp"
+
+enum class LogLevel : uint8_t { DEBUG = 1, INFO, WARNING, ERROR, CRITICAL };
+
+// Output format used by the writers when rendering a record.
+enum class LogFormat : uint8_t { TEXT, JSON, LOGFMT };
+
+inline const char* levelToString(LogLevel level) {
+  switch (level) {
+    case LogLevel::DEBUG:
+      return "DEBUG";
+    case LogLevel::INFO:
+      return "INFO";
+    case LogLevel::WARNING:
+      return "WARNING";
+    case LogLevel::ERROR:
+      return "ERROR";
+    case LogLevel::CRITICAL:
+      return "CRITICAL";
+    default:
+      return "UNKNOWN";
+  }
+}
+
+// The spellings of a field key in every output format. The views point at static storage, see
+// StaticFieldKey.
+struct FieldKey {
+  std::string_view name;
+  std::string_view json;    // Quoted and escaped, ready to be copied into a JSON object.
+  std::string_view logfmt;  // Bytes that are not allowed in a logfmt key are replaced with '_'.
+};
+
+namespace detail {
+
+// Writes the JSON spelling of key byte `c` to `out` and returns its length, at most 6 bytes.
+constexpr size_t escapeKeyChar(char c, char* out) {
+  constexpr char hex[] = "0123456789abcdef";
+  const auto u = static_cast<unsigned char>(c);
+  if (c == '"' || c == '\\') {
+    out[0] = '\\';
+    out[1] = c;
+    return 2;
+  }
+  if (u < 0x20) {
+    out[0] = '\\';
+    out[1] = 'u';
+    out[2] = '0';
+    out[3] = '0';
+    out[4] = hex[u >> 4];
+    out[5] = hex[u & 0xf];
+    return 6;
+  }
+  out[0] = c;
+  return 1;
+}
+
+// Bytes that are not allowed in a logfmt key are replaced with '_'.
+constexpr char logfmtKeyChar(char c) {
+  const auto u = static_cast<unsigned char>(c);
+  return (u <= ' ' || c == '=' || c == '"') ? '_' : c;
+}
+
+}  // namespace detail
+
+// Escapes a key once at compile time so the sink only copies bytes when rendering a record.
+template <size_t N>
+class StaticFieldKey {
+  public:
+  constexpr StaticFieldKey(const char (&name)[N]) {
+    json_[json_size_++] = '"';
+    for (size_t i = 0; i + 1 < N; ++i) {
+      name_[i] = name[i];
+      logfmt_[i] = detail::logfmtKeyChar(name[i]);
+      json_size_ += detail::escapeKeyChar(name[i], json_ + json_size_);
+    }
+    json_[json_size_++] = '"';
+  }
+
+  constexpr FieldKey key() const {
+    return {{name_, N - 1}, {json_, json_size_}, {logfmt_, N - 1}};
+  }
+
+  private:
+  char name_[N]{};
+  char logfmt_[N]{};
+  char json_[6 * N + 2]{};
+  size_t json_size_{0};
+};
+
+// The spellings of a key only known at runtime, e.g. one read back from shared memory. The views
+// returned by key() point into this object.
+class OwnedFieldKey {
+  public:
+  explicit OwnedFieldKey(std::string_view name) : name_(name) {
+    json_ += '"';
+    for (char c : name) {
+      char escaped[6];
+      json_.append(escaped, detail::escapeKeyChar(c, escaped));
+      logfmt_ += detail::logfmtKeyChar(c);
+    }
+    json_ += '"';
+  }
+
+  FieldKey key() const {
+    return {name_, json_, logfmt_};
+  }
+
+  private:
+  std::string name_;
+  std::string json_;
+  std::string logfmt_;
+};
+
+using FieldValue = std::variant<int64_t, uint64_t, double, bool, std::string>;
+
+// A typed key/value pair attached to a record.
+struct Field {
+  template <typename T>
+  Field(FieldKey key, T&& value) : key(key), value(toValue(std::forward<T>(value))) {}
+
+  FieldKey key;
+  FieldValue value;
+
+  private:
+  template <typename T>
+  static FieldValue toValue(T&& value) {
+    using U = std::decay_t<T>;
+    if constexpr (std::is_same_v<U, bool>) {
+      return value;
+    } else if constexpr (std::is_integral_v<U> && std::is_signed_v<U>) {
+      return static_cast<int64_t>(value);
+    } else if constexpr (std::is_integral_v<U>) {
+      return static_cast<uint64_t>(value);
+    } else if constexpr (std::is_floating_point_v<U>) {
+      return static_cast<double>(value);
+    } else if constexpr (std::is_constructible_v<std::string, T>) {
+      return std::string(std::forward<T>(value));
+    } else {
+      std::stringstream ss;
+      ss << value;
+      return ss.str();
+    }
+  }
+};
+
+// Attaches a field to a log call, e.g. LOG_INFO("login", LOG_FIELD("user", name)).
+// The key must be a string literal.
+#define LOG_FIELD(name, value)                                 \
+  Field(                                                       \
+      []() {                                                   \
+        static constexpr StaticFieldKey<sizeof(name)> k(name); \
+        return k.key();                                        \
+      }(),                                                     \
+      value)
+
+enum class RecordKind : uint8_t {
+  LOG,
+  // A timed span, see ScopeTimer. `time` is when it began.
+  SPAN,
+};
+
+// A small number identifying the calling thread, stable for the lifetime of the thread.
+inline uint32_t currentThreadId() {
+  static std::atomic<uint32_t> next_id{1};
+  thread_local uint32_t id = next_id.fetch_add(1, std::memory_order_relaxed);
+  return id;
+}
+
+// A single log record as it travels from the producers to the writers.
+struct LogRecord {
+  std::chrono::system_clock::time_point time;
+  LogLevel level = LogLevel::INFO;
+  std::string message;
+  std::vector<Field> fields;
+  // Messages above the pool threshold are kept here instead of in `message`.
+  MessagePool::Handle large_message;
+
+  // Spans carry no message, only their static name and end time.
+  RecordKind kind = RecordKind::LOG;
+  std::string_view span_name;
+  std::chrono::system_clock::time_point span_end;
+  uint32_t thread_id = 0;
+
+  std::string_view text() const {
+    return large_message ? std::string_view(*large_message) : std::string_view(message);
+  }
+
+  int64_t spanMicros() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(span_end - time).count();
+  }
+};
+
+#endif  // RECORD_HPP
@@ -1,64 +1,153 @@
 #ifndef RING_BUFFER_HPP
 #define RING_BUFFER_HPP
 
+#include <algorithm>
 #include <atomic>
 #include <memory>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+// Bounded queue for many producers and a single consumer. Every slot carries a sequence number
+// that tells whether it is free for the producer at position `pos` (2 * pos) or holds the item
+// written at `pos` (2 * pos + 1), so a slot is only handed out again once the consumer is done
+// with it. Slots are reused in place: items written with produce() or copied in with
+// push(const T&) keep the storage of the slot, e.g. the capacity of a std::string.
 template <typename T>
 class RingBuffer {
   public:
   static constexpr size_t DEFAULT_CAPACITY = 2000;
   explicit RingBuffer(size_t capacity = DEFAULT_CAPACITY)
-      : capacity_(capacity), buffer_size_(capacity + 1), buffer_(capacity + 1), head_(0), tail_(0) {
+      : capacity_(capacity), buffer_(capacity), head_(0), tail_(0) {
     if (capacity == 0) {
       throw std::invalid_argument("Capacity must be greater than 0");
     }
+    reset();
   }
 
   bool push(const T& item) {
-    return emplace_push(item);
+    return produce([&item](T& slot) { slot = item; });
   }
 
   bool push(T&& item) {
-    return emplace_push(std::move(item));
+    return produce([&item](T& slot) { slot = std::move(item); });
   }
 
   template <typename... Args>
   bool emplace(Args&&... args) {
     T item(std::forward<Args>(args)...);
-    return emplace_push(std::move(item));
+    return push(std::move(item));
   }
 
-  std::pair<T&, bool> pop() {
-    size_t current_tail = tail_.load(std::memory_order_relaxed);
-    // buffer is empty.
-    if (current_tail == head_.load(std::memory_order_acquire)) {
-      T t{};
-      return {t, false};
+  // Claims a free slot and lets `fill` write the item into it in place. Returns false without
+  // calling `fill` if the buffer is full. Safe to call from many threads. `fill` may also take
+  // the position of the item, the number of items produced before it, which is the order the
+  // consumer sees them in. If `fill` throws, the slot is published as a tombstone the consumer
+  // skips, so the items behind it are not held up, and the exception is passed on.
+  template <typename F>
+  bool produce(F&& fill) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    Slot* slot = nullptr;
+    while (true) {
+      slot = &buffer_[pos % capacity_];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      if (sequence == 2 * pos) {
+        if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (sequence < 2 * pos) {
+        // The consumer has not released this slot from the previous round yet.
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
     }
+    struct Publish {
+      Slot* slot;
+      size_t pos;
+      bool filled = false;
+      ~Publish() {
+        slot->skip = !filled;
+        slot->sequence.store(2 * pos + 1, std::memory_order_release);
+      }
+    } publish{slot, pos};
+    if constexpr (std::is_invocable_v<F, T&, size_t>) {
+      fill(slot->item, pos);
+    } else {
+      fill(slot->item);
+    }
+    publish.filled = true;
+    return true;
+  }
 
-    T& item = buffer_[current_tail];
-    tail_.store((current_tail + 1) % buffer_size_, std::memory_order_release);
-    return {item, true};
+  // Hands the oldest item to `use` and releases its slot once `use` returns, so the item can be
+  // used in place without copying it out. Returns false if the buffer is empty. Only one thread
+  // may consume.
+  template <typename F>
+  bool consume(F&& use) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Slot* slot = &buffer_[pos % capacity_];
+    while (slot->sequence.load(std::memory_order_acquire) == 2 * pos + 1 && slot->skip) {
+      // Whatever the failed fill left in the tombstone is dropped along with it.
+      slot->item = T{};
+      slot->skip = false;
+      tail_.store(pos + 1, std::memory_order_relaxed);
+      slot->sequence.store(2 * (pos + capacity_), std::memory_order_release);
+      slot = &buffer_[++pos % capacity_];
+    }
+    if (slot->sequence.load(std::memory_order_acquire) != 2 * pos + 1) {
+      return false;
+    }
+    use(slot->item);
+    tail_.store(pos + 1, std::memory_order_relaxed);
+    slot->sequence.store(2 * (pos + capacity_), std::memory_order_release);
+    return true;
+  }
+
+  // Moves the oldest item out of the buffer. Prefer consume() on hot paths, since it leaves the
+  // storage of the item in the slot for reuse.
+  std::pair<T, bool> pop() {
+    std::pair<T, bool> result{T{}, false};
+    result.second = consume([&result](T& item) { result.first = std::move(item); });
+    return result;
   }
 
+  // Whether the consumer would find nothing to consume right now.
   bool isEmpty() const {
-    return tail_.load(std::memory_order_acquire) == head_.load(std::memory_order_acquire);
+    for (size_t pos = tail_.load(std::memory_order_relaxed);; ++pos) {
+      const Slot& slot = buffer_[pos % capacity_];
+      if (slot.sequence.load(std::memory_order_acquire) != 2 * pos + 1) {
+        return true;
+      }
+      if (!slot.skip) {
+        return false;
+      }
+    }
   }
 
   bool isFull() const {
-    return (head_.load(std::memory_order_acquire) + 1) % buffer_size_ ==
-           tail_.load(std::memory_order_acquire);
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire) >=
+           capacity_;
   }
 
   size_t capacity() const {
     return capacity_;
   }
 
+  // Items queued or being written right now. Only a snapshot while producers and the consumer
+  // are running.
+  size_t size() const {
+    const size_t tail = tail_.load(std::memory_order_acquire);
+    const size_t head = head_.load(std::memory_order_acquire);
+    return head > tail ? std::min(head - tail, capacity_) : 0;
+  }
+
+  // Not thread safe.
   void reset() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      buffer_[i].sequence.store(2 * i, std::memory_order_relaxed);
+    }
     tail_.store(0, std::memory_order_release);
     head_.store(0, std::memory_order_release);
   }
@@ -66,25 +155,18 @@ class RingBuffer {
   ~RingBuffer() {}
 
   private:
-  const size_t capacity_;
-  const size_t buffer_size_;
-  std::vector<T> buffer_;
-  std::atomic<size_t> head_;  // Write index
-  std::atomic<size_t> tail_;  // Read index
-
-  template <typename U>
-  bool emplace_push(U&& item) {
-    size_t current_head = head_.load(std::memory_order_relaxed);
-
-    size_t next_head = (current_head + 1) % buffer_size_;
-    if (next_head == tail_.load(std::memory_order_acquire)) {
-      return false;
-    }
+  struct Slot {
+    std::atomic<size_t> sequence{0};
+    T item{};
+    // Set on a published slot whose fill threw.
+    bool skip = false;
+  };
 
-    buffer_[current_head] = std::forward<U>(item);
-    head_.store(next_head, std::memory_order_release);
-    return true;
-  }
+  const size_t capacity_;
+  std::vector<Slot> buffer_;
+  // Producers and the consumer touch different indices, keep them on separate cache lines.
+  alignas(64) std::atomic<size_t> head_;  // Write index
+  alignas(64) std::atomic<size_t> tail_;  // Read index
 };
 
-#endif  // RING_BUFFER_HPP
\ No newline at end of file
+#endif  // RING_BUFFER_HPP
@@ -0,0 +1,589 @@
+#ifndef SHM_RING_BUFFER_HPP
+#define SHM_RING_BUFFER_HPP
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "record.hpp"
+
+// Log records shared between processes through a named POSIX shared memory segment.
+//
+// The segment starts with a header (magic, version, geometry) followed by a number of regions.
+// Every producing process claims one region by writing its pid into it, so processes never contend
+// with each other, and a collector process drains all regions. A region is a ring of fixed-size
+// slots using the same sequence protocol as RingBuffer: 2 * pos marks a slot free for position
+// `pos` and 2 * pos + 1 marks it published. Records longer than one slot take several consecutive
+// slots. The segment outlives the processes, so the records of a producer that crashed can still be
+// collected. The fields of a log record are encoded in front of its message, see appendFields().
+namespace shm {
+
+static constexpr uint64_t MAGIC = 0x524853474f4c4346;  // "FCLOGSHR"
+static constexpr uint32_t VERSION = 2;
+// Owner of a region whose dead producer is being cleaned up after, see Region::reclaim().
+static constexpr int32_t RECOVERING = -1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "Shared atomics must be lock free");
+static_assert(std::atomic<int32_t>::is_always_lock_free, "Shared atomics must be lock free");
+
+struct SegmentHeader {
+  // Written last by the creator, attaching processes wait for it.
+  std::atomic<uint64_t> magic;
+  uint32_t version;
+  uint32_t region_count;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint64_t region_bytes;
+};
+
+struct RegionHeader {
+  // pid of the producer, 0 if the region is free, RECOVERING while a collector cleans up after a
+  // dead producer.
+  alignas(64) std::atomic<int32_t> owner;
+  alignas(64) std::atomic<uint64_t> head;  // Write index
+  alignas(64) std::atomic<uint64_t> tail;  // Read index
+};
+
+enum class SlotKind : uint8_t {
+  LOG,
+  SPAN,
+  // Holds the rest of the payload of the record in a preceding slot.
+  CONTINUATION,
+};
+
+struct SlotHeader {
+  std::atomic<uint64_t> sequence;
+  int64_t time_ns;
+  int64_t end_ns;
+  uint32_t size;   // Payload bytes of the whole record
+  uint32_t slots;  // Slots taken by the record
+  uint32_t thread_id;
+  uint8_t level;
+  SlotKind kind;
+  uint16_t field_count;
+};
+
+// A record as written by a producer. For spans the payload is the span name, for log records it
+// is `field_count` encoded fields followed by the message.
+struct Record {
+  int64_t time_ns = 0;
+  int64_t end_ns = 0;
+  uint32_t thread_id = 0;
+  uint8_t level = 0;
+  SlotKind kind = SlotKind::LOG;
+  uint16_t field_count = 0;
+  std::string_view payload;
+};
+
+// Encodes fields for a record payload. Each field is its type (the index in FieldValue) as one
+// byte, its key as a 16-bit length and the bytes, and its value: 8 bytes for numbers, one byte for
+// bools and a 32-bit length and the bytes for strings. Returns the number of fields encoded.
+inline uint16_t appendFields(std::string& out, const std::vector<Field>& fields) {
+  const auto append = [&out](const auto& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  const size_t count = std::min<size_t>(fields.size(), std::numeric_limits<uint16_t>::max());
+  for (size_t i = 0; i < count; ++i) {
+    const Field& field = fields[i];
+    const std::string_view name =
+        field.key.name.substr(0, std::numeric_limits<uint16_t>::max());
+    out += static_cast<char>(field.value.index());
+    append(static_cast<uint16_t>(name.size()));
+    out.append(name.data(), name.size());
+    if (const auto* text = std::get_if<std::string>(&field.value)) {
+      const size_t size = std::min<size_t>(text->size(), std::numeric_limits<uint32_t>::max());
+      append(static_cast<uint32_t>(size));
+      out.append(text->data(), size);
+    } else {
+      std::visit(
+          [&append](const auto& value) {
+            if constexpr (!std::is_same_v<std::decay_t<decltype(value)>, std::string>) {
+              append(value);
+            }
+          },
+          field.value);
+    }
+  }
+  return static_cast<uint16_t>(count);
+}
+
+// Turns the payload of a log record back into its fields and message. Keys are kept for the life
+// of the decoder, records only hold views of them.
+class FieldDecoder {
+  public:
+  // Appends the `count` fields at the front of `payload` to `fields` and returns the message
+  // behind them. A malformed payload, e.g. one cut off at the ring size, yields no fields and the
+  // raw payload as message.
+  std::string_view decode(std::string_view payload, uint16_t count, std::vector<Field>& fields) {
+    const size_t first = fields.size();
+    std::string_view rest = payload;
+    for (uint16_t i = 0; i < count; ++i) {
+      if (!decodeField(rest, fields)) {
+        fields.erase(fields.begin() + first, fields.end());
+        return payload;
+      }
+    }
+    return rest;
+  }
+
+  private:
+  template <typename T>
+  static bool read(std::string_view& in, T& value) {
+    if (in.size() < sizeof(T)) {
+      return false;
+    }
+    std::memcpy(&value, in.data(), sizeof(T));
+    in.remove_prefix(sizeof(T));
+    return true;
+  }
+
+  static bool readBytes(std::string_view& in, size_t size, std::string_view& bytes) {
+    if (in.size() < size) {
+      return false;
+    }
+    bytes = in.substr(0, size);
+    in.remove_prefix(size);
+    return true;
+  }
+
+  template <typename T>
+  static bool readValue(std::string_view& in, const FieldKey& key, std::vector<Field>& fields) {
+    T value{};
+    if (!read(in, value)) {
+      return false;
+    }
+    fields.emplace_back(key, value);
+    return true;
+  }
+
+  bool decodeField(std::string_view& in, std::vector<Field>& fields) {
+    static_assert(std::variant_size_v<FieldValue> == 5, "Update the field encoding");
+    uint8_t type = 0;
+    uint16_t name_size = 0;
+    std::string_view name;
+    if (!read(in, type) || !read(in, name_size) || !readBytes(in, name_size, name)) {
+      return false;
+    }
+    const FieldKey key = this->key(name);
+    // Types are numbered in the order of the FieldValue alternatives.
+    switch (type) {
+      case 0:
+        return readValue<int64_t>(in, key, fields);
+      case 1:
+        return readValue<uint64_t>(in, key, fields);
+      case 2:
+        return readValue<double>(in, key, fields);
+      case 3: {
+        uint8_t value = 0;
+        if (!read(in, value)) {
+          return false;
+        }
+        fields.emplace_back(key, value != 0);
+        return true;
+      }
+      case 4: {
+        uint32_t size = 0;
+        std::string_view value;
+        if (!read(in, size) || !readBytes(in, size, value)) {
+          return false;
+        }
+        fields.emplace_back(key, value);
+        return true;
+      }
+      default:
+        return false;
+    }
+  }
+
+  FieldKey key(std::string_view name) {
+    auto it = keys_.find(name);
+    if (it == keys_.end()) {
+      it = keys_.emplace(std::string(name), OwnedFieldKey(name)).first;
+    }
+    return it->second.key();
+  }
+
+  std::map<std::string, OwnedFieldKey, std::less<>> keys_;
+};
+
+// Geometry of a segment: `regions` producers with `slots` slots of `slot_size` bytes each.
+struct Options {
+  uint32_t regions = 16;
+  uint32_t slots = 4096;
+  uint32_t slot_size = 256;
+};
+
+static constexpr size_t align64(size_t size) {
+  return (size + 63) / 64 * 64;
+}
+
+// A view of one region inside a mapped segment.
+class Region {
+  public:
+  Region(RegionHeader* header, char* slots, uint32_t slot_count, uint32_t slot_size)
+      : header_(header), slots_(slots), slot_count_(slot_count), slot_size_(slot_size) {}
+
+  int32_t owner() const {
+    return header_->owner.load(std::memory_order_acquire);
+  }
+
+  bool claim(int32_t pid) {
+    int32_t expected = 0;
+    return header_->owner.compare_exchange_strong(expected, pid, std::memory_order_acq_rel);
+  }
+
+  // Gives the region up. Records already published stay in it for the collector.
+  void release(int32_t pid) {
+    header_->owner.compare_exchange_strong(pid, 0, std::memory_order_acq_rel);
+  }
+
+  // Takes the region over from `pid`, a producer found dead, so nobody can claim it while its
+  // leftovers are skipped. Fails if the region changed hands since `pid` was read, e.g. the
+  // producer released it and a new one claimed it. Release it with release(RECOVERING).
+  bool reclaim(int32_t pid) {
+    return pid > 0 &&
+           header_->owner.compare_exchange_strong(pid, RECOVERING, std::memory_order_acq_rel);
+  }
+
+  // Publishes a record, splitting the payload over as many slots as needed. Payloads that would
+  // not fit into the whole ring are truncated. Returns false if the ring is full. Safe to call
+  // from many threads of the owning process.
+  bool produce(const Record& record) {
+    const size_t payload = payloadSize();
+    std::string_view data = record.payload.substr(0, payload * slot_count_);
+    const uint64_t slots = std::max<uint64_t>(1, (data.size() + payload - 1) / payload);
+    uint64_t pos = 0;
+    if (!reserve(slots, pos)) {
+      return false;
+    }
+
+    // Publish the continuation slots first, so the consumer sees the whole record once the first
+    // slot is published.
+    for (uint64_t i = 1; i < slots; ++i) {
+      SlotHeader* s = slot(pos + i);
+      s->kind = SlotKind::CONTINUATION;
+      std::string_view chunk = data.substr(i * payload, payload);
+      std::memcpy(payloadOf(s), chunk.data(), chunk.size());
+      s->sequence.store(2 * (pos + i) + 1, std::memory_order_release);
+    }
+    SlotHeader* s = slot(pos);
+    s->time_ns = record.time_ns;
+    s->end_ns = record.end_ns;
+    s->size = static_cast<uint32_t>(data.size());
+    s->slots = static_cast<uint32_t>(slots);
+    s->thread_id = record.thread_id;
+    s->level = record.level;
+    s->kind = record.kind;
+    s->field_count = record.field_count;
+    std::memcpy(payloadOf(s), data.data(), std::min(data.size(), payload));
+    s->sequence.store(2 * pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Claims `slots` consecutive slots and sets `pos` to the first of them. Returns false if the
+  // ring is full. produce() publishes the slots right after claiming them; if the producer dies
+  // in between, skipAbandoned() gets rid of them.
+  bool reserve(uint64_t slots, uint64_t& pos) {
+    pos = header_->head.load(std::memory_order_relaxed);
+    while (true) {
+      // The consumer releases slots in order, so if the last slot is free all of them are.
+      const uint64_t last = pos + slots - 1;
+      const uint64_t sequence = slot(last)->sequence.load(std::memory_order_acquire);
+      if (sequence == 2 * last) {
+        if (header_->head.compare_exchange_weak(pos, pos + slots, std::memory_order_relaxed)) {
+          return true;
+        }
+      } else if (sequence < 2 * last) {
+        return false;
+      } else {
+        pos = header_->head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Hands the oldest record to `use`. Multi-slot payloads are gathered into `scratch`, single
+  // slot ones are used in place. Returns false if nothing is published. Only one process may
+  // consume a region.
+  template <typename F>
+  bool consume(F&& use, std::string& scratch) {
+    const uint64_t pos = header_->tail.load(std::memory_order_relaxed);
+    SlotHeader* s = slot(pos);
+    if (s->sequence.load(std::memory_order_acquire) != 2 * pos + 1) {
+      return false;
+    }
+    const uint64_t slots = s->slots;
+    Record record;
+    record.time_ns = s->time_ns;
+    record.end_ns = s->end_ns;
+    record.thread_id = s->thread_id;
+    record.level = s->level;
+    record.kind = s->kind;
+    record.field_count = s->field_count;
+    const size_t payload = payloadSize();
+    if (slots == 1) {
+      record.payload = std::string_view(payloadOf(s), s->size);
+    } else {
+      scratch.clear();
+      for (uint64_t i = 0; i < slots; ++i) {
+        scratch.append(payloadOf(slot(pos + i)), std::min<size_t>(payload, s->size - i * payload));
+      }
+      record.payload = scratch;
+    }
+    use(record);
+    releaseSlots(pos, slots);
+    return true;
+  }
+
+  // Skips slots that were claimed but never published, which only happens when the producer died
+  // while writing. Must only be called while the region is reclaimed, see reclaim(), and once
+  // everything published has been consumed. Returns the number of slots skipped.
+  size_t skipAbandoned() {
+    size_t skipped = 0;
+    uint64_t pos = header_->tail.load(std::memory_order_relaxed);
+    const uint64_t head = header_->head.load(std::memory_order_acquire);
+    while (pos < head) {
+      SlotHeader* s = slot(pos);
+      const bool published = s->sequence.load(std::memory_order_acquire) == 2 * pos + 1;
+      if (published && s->kind != SlotKind::CONTINUATION) {
+        break;
+      }
+      releaseSlots(pos, 1);
+      ++pos;
+      ++skipped;
+    }
+    return skipped;
+  }
+
+  size_t payloadSize() const {
+    return slot_size_ - sizeof(SlotHeader);
+  }
+
+  private:
+  SlotHeader* slot(uint64_t pos) const {
+    return reinterpret_cast<SlotHeader*>(slots_ + (pos % slot_count_) * slot_size_);
+  }
+
+  static char* payloadOf(SlotHeader* s) {
+    return reinterpret_cast<char*>(s) + sizeof(SlotHeader);
+  }
+
+  void releaseSlots(uint64_t pos, uint64_t slots) {
+    for (uint64_t i = 0; i < slots; ++i) {
+      slot(pos + i)->sequence.store(2 * (pos + i + slot_count_), std::memory_order_release);
+    }
+    header_->tail.store(pos + slots, std::memory_order_relaxed);
+  }
+
+  RegionHeader* header_;
+  char* slots_;
+  uint32_t slot_count_;
+  uint32_t slot_size_;
+};
+
+// A mapping of a named shared memory segment.
+class Segment {
+  public:
+  // Attaches to the segment called `name`, creating it with `options` if it does not exist yet.
+  // The geometry of an existing segment wins over `options`.
+  static std::unique_ptr<Segment> open(const std::string& name, const Options& options = {}) {
+    if (options.regions == 0 || options.slots == 0 || options.slot_size <= sizeof(SlotHeader)) {
+      throw std::invalid_argument("Invalid shared memory segment options");
+    }
+    const size_t slot_size = align64(options.slot_size);
+    const size_t region_bytes = align64(sizeof(RegionHeader)) + options.slots * slot_size;
+    const size_t size = align64(sizeof(SegmentHeader)) + options.regions * region_bytes;
+
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+      if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        throw std::runtime_error("Cannot size shared memory segment: " + name);
+      }
+      void* memory = map(fd, size, name);
+      char* base = static_cast<char*>(memory);
+      auto* header = new (base) SegmentHeader{};
+      header->version = VERSION;
+      header->region_count = options.regions;
+      header->slot_count = options.slots;
+      header->slot_size = static_cast<uint32_t>(slot_size);
+      header->region_bytes = region_bytes;
+      auto segment = std::unique_ptr<Segment>(new Segment(name, memory, size));
+      for (uint32_t r = 0; r < options.regions; ++r) {
+        char* region = segment->regionBase(r);
+        new (region) RegionHeader{};
+        char* slots = region + align64(sizeof(RegionHeader));
+        for (uint32_t i = 0; i < options.slots; ++i) {
+          auto* s = new (slots + i * slot_size) SlotHeader{};
+          s->sequence.store(2 * i, std::memory_order_relaxed);
+        }
+      }
+      header->magic.store(MAGIC, std::memory_order_release);
+      return segment;
+    }
+    if (errno != EEXIST) {
+      throw std::runtime_error("Cannot create shared memory segment: " + name);
+    }
+    return attach(name);
+  }
+
+  // Attaches to an existing segment, waiting briefly for its creator to finish setting it up.
+  static std::unique_ptr<Segment> attach(const std::string& name) {
+    int fd = ::shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open shared memory segment: " + name);
+    }
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    struct stat st {};
+    while (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(SegmentHeader)) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        ::close(fd);
+        throw std::runtime_error("Shared memory segment was never initialized: " + name);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* memory = map(fd, size, name);
+    auto segment = std::unique_ptr<Segment>(new Segment(name, memory, size));
+    while (segment->header()->magic.load(std::memory_order_acquire) != MAGIC) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        throw std::runtime_error("Shared memory segment was never initialized: " + name);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    const SegmentHeader* header = segment->header();
+    if (header->version != VERSION) {
+      throw std::runtime_error("Shared memory segment " + name + " has version " +
+                               std::to_string(header->version) + ", expected " +
+                               std::to_string(VERSION));
+    }
+    if (align64(sizeof(SegmentHeader)) + header->region_count * header->region_bytes > size) {
+      throw std::runtime_error("Shared memory segment is truncated: " + name);
+    }
+    return segment;
+  }
+
+  static void unlink(const std::string& name) {
+    ::shm_unlink(name.c_str());
+  }
+
+  Segment(const Segment&) = delete;
+  Segment& operator=(const Segment&) = delete;
+
+  ~Segment() {
+    ::munmap(memory_, size_);
+  }
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  uint32_t regionCount() const {
+    return header()->region_count;
+  }
+
+  Region region(uint32_t index) {
+    const SegmentHeader* h = header();
+    char* base = regionBase(index);
+    return Region(reinterpret_cast<RegionHeader*>(base),
+                  base + align64(sizeof(RegionHeader)),
+                  h->slot_count,
+                  h->slot_size);
+  }
+
+  // Claims a free region for `pid` and returns its index.
+  uint32_t claimRegion(int32_t pid) {
+    for (uint32_t r = 0; r < regionCount(); ++r) {
+      if (region(r).claim(pid)) {
+        return r;
+      }
+    }
+    throw std::runtime_error("No free region in shared memory segment: " + name_);
+  }
+
+  // Whether the process owning a region has exited.
+  static bool ownerDead(int32_t pid) {
+    return pid > 0 && ::kill(pid, 0) != 0 && errno == ESRCH;
+  }
+
+  private:
+  Segment(const std::string& name, void* memory, size_t size)
+      : name_(name), memory_(memory), size_(size) {}
+
+  static void* map(int fd, size_t size, const std::string& name) {
+    void* memory = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+      throw std::runtime_error("Cannot map shared memory segment: " + name);
+    }
+    return memory;
+  }
+
+  SegmentHeader* header() const {
+    return static_cast<SegmentHeader*>(memory_);
+  }
+
+  char* regionBase(uint32_t index) const {
+    return static_cast<char*>(memory_) + align64(sizeof(SegmentHeader)) +
+           index * header()->region_bytes;
+  }
+
+  std::string name_;
+  void* memory_;
+  size_t size_;
+};
+
+// The region a process writes its records to. Gives the region back when destroyed.
+class Producer {
+  public:
+  explicit Producer(const std::string& name, const Options& options = {})
+      : segment_(Segment::open(name, options)),
+        pid_(static_cast<int32_t>(::getpid())),
+        index_(segment_->claimRegion(pid_)),
+        region_(segment_->region(index_)) {}
+
+  ~Producer() {
+    region_.release(pid_);
+  }
+
+  Producer(const Producer&) = delete;
+  Producer& operator=(const Producer&) = delete;
+
+  bool produce(const Record& record) {
+    return region_.produce(record);
+  }
+
+  uint32_t regionIndex() const {
+    return index_;
+  }
+
+  private:
+  std::unique_ptr<Segment> segment_;
+  int32_t pid_;
+  uint32_t index_;
+  Region region_;
+};
+
+}  // namespace shm
+
+#endif  // SHM_RING_BUFFER_HPP
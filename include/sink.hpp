@@ -1,70 +1,251 @@
 #ifndef SINK_HPP
 #define SINK_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#include "commit_log.hpp"
+#include "record.hpp"
 #include "ring_buffer.hpp"
 #include "writer.hpp"
 
+// Outcome of draining a sink on shutdown.
+struct ShutdownReport {
+  // Records the sink wrote, including the ones written before the shutdown was requested.
+  size_t flushed = 0;
+  // Records still queued when the deadline passed. They are discarded.
+  size_t abandoned = 0;
+  // Records refused by the logger because the queue or the large message pool was full.
+  size_t dropped = 0;
+  // Group commits made in durable mode and the records they made durable.
+  size_t syncs = 0;
+  size_t synced = 0;
+};
+
 class Sink {
+  // Message storage a ring buffer slot may keep for reuse.
+  static constexpr size_t MAX_SLOT_CAPACITY = 4 * KB;
+
   public:
-  explicit Sink(std::shared_ptr<RingBuffer<std::string>> buffer,
-                std::vector<WriterFactory::WriterType> writer_types,
-                const std::string& loger_filename)
-      : buffer_(buffer), finished_(false) {
-    // Build writers
-    for (const auto& writer_type : writer_types) {
-      writers_.push_back(WriterFactory::create_writer(writer_type, loger_filename));
+  using Clock = std::chrono::steady_clock;
+
+  // Takes writers that are already open. With a trace writer, spans go there instead of being
+  // logged as lines.
+  Sink(std::shared_ptr<RingBuffer<LogRecord>> buffer,
+       std::vector<std::unique_ptr<Writer>> writers,
+       std::unique_ptr<Writer> trace_writer,
+       std::shared_ptr<CommitLog> commit_log = nullptr)
+      : buffer_(std::move(buffer)),
+        writers_(std::move(writers)),
+        trace_writer_(std::move(trace_writer)),
+        finished_(false),
+        commit_log_(std::move(commit_log)) {
+    if (commit_log_) {
+      commit_ = commit_log_->options();
     }
     // Start processing in a separate thread
     process_thread_ = std::thread(&Sink::process, this);
   }
+
+  // A DATAGRAM writer sends to `datagram_address`, the others use `loger_filename`.
+  static std::vector<std::unique_ptr<Writer>> createWriters(
+      const std::vector<WriterFactory::WriterType>& writer_types,
+      const std::string& loger_filename,
+      LogFormat format = LogFormat::TEXT,
+      size_t index_block_size = 0,
+      const std::string& datagram_address = "") {
+    std::vector<std::unique_ptr<Writer>> writers;
+    for (const auto& writer_type : writer_types) {
+      const bool datagram = writer_type == WriterFactory::WriterType::DATAGRAM;
+      writers.push_back(WriterFactory::create_writer(writer_type,
+                                                     datagram ? datagram_address : loger_filename,
+                                                     format,
+                                                     index_block_size));
+    }
+    return writers;
+  }
+
+  static std::unique_ptr<Writer> createTraceWriter(const std::string& trace_filename) {
+    if (trace_filename.empty()) {
+      return nullptr;
+    }
+    return WriterFactory::create_writer(WriterFactory::WriterType::TRACE, trace_filename);
+  }
+
   ~Sink() {
+    finish();
   }
 
-  void finish() {
-    finished_.store(true, std::memory_order_release);
-    // Make sure all the writers are flushed.
+  // Drains the buffer and flushes the writers. Records still queued at `deadline` are abandoned.
+  // The caller must make sure nothing is pushed to the buffer any more. Calling it again returns
+  // the first report.
+  ShutdownReport finish(Clock::time_point deadline = Clock::time_point::max()) {
     if (process_thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        deadline_ = deadline;
+        finished_.store(true, std::memory_order_release);
+      }
+      wake_.notify_one();
+      // Make sure all the writers are flushed.
       process_thread_.join();
     }
+    return report_;
   }
 
   private:
   // Process items from the buffer until empty
   void process() {
     while (true) {
-      auto [item, success] = buffer_->pop();
-      // std::cout << "Processing item: " << item << std::endl;
+      const bool finishing = finished_.load(std::memory_order_acquire);
+      if (finishing && Clock::now() >= deadline_) {
+        if (commit_log_) {
+          // Commit what was written, the abandoned records will never be durable.
+          if (consumed_ > committed_) {
+            commit();
+          }
+          commit_log_->close();
+        }
+        while (buffer_->consume([](LogRecord& item) { item.large_message.reset(); })) {
+          ++report_.abandoned;
+        }
+      }
+      // The record is written straight from its slot, which is released afterwards.
+      bool success = buffer_->consume([this](LogRecord& item) {
+        if (item.kind == RecordKind::SPAN && trace_writer_) {
+          trace_writer_->write(item);
+        } else {
+          for (const auto& writer : writers_) {
+            writer->write(item);
+          }
+        }
+        queued_at_ = item.time;
+        // Hand large messages back to the pool now rather than when the slot is reused.
+        item.large_message.reset();
+        // Slots keep their storage for the next producer, up to a limit.
+        if (item.message.capacity() > MAX_SLOT_CAPACITY) {
+          std::string().swap(item.message);
+        }
+      });
+      if (success) {
+        ++consumed_;
+        ++report_.flushed;
+      }
+      if (commit_log_ && consumed_ > committed_) {
+        // Group commit: a batch starts when its first record was queued and is synced once it is
+        // full, or once its interval is up and the records queued by then are written.
+        const auto now = Clock::now();
+        if (consumed_ - committed_ == 1 && success) {
+          const auto waited = std::chrono::system_clock::now() - queued_at_;
+          batch_start_ = now - std::clamp<Clock::duration>(
+                                   std::chrono::duration_cast<Clock::duration>(waited),
+                                   Clock::duration::zero(),
+                                   commit_.interval);
+        }
+        const bool expired = now - batch_start_ >= commit_.interval;
+        if (!success && !finishing && !expired) {
+          // Give the rest of the batch until the end of the interval to come in.
+          std::unique_lock<std::mutex> lock(wake_mutex_);
+          wake_.wait_until(lock, batch_start_ + commit_.interval, [this]() {
+            return finished_.load(std::memory_order_relaxed);
+          });
+          continue;
+        }
+        bool sync = !success || consumed_ - committed_ >= commit_.max_batch;
+        if (!sync && expired) {
+          if (batch_end_ == 0) {
+            batch_end_ = consumed_ + buffer_->size();
+          }
+          sync = consumed_ >= batch_end_;
+        }
+        if (sync) {
+          commit();
+        }
+      }
       if (!success) {
         // Empty the buffer, if finished_ is set, we exit the loop
-        if (finished_.load(std::memory_order_relaxed)) {
+        if (finishing) {
+          if (commit_log_) {
+            commit_log_->close();
+          }
           for (const auto& writer : writers_) {
             writer->flush();
           }
+          if (trace_writer_) {
+            trace_writer_->flush();
+          }
           break;
         }
-        // Buffer is empty, wait for 100ms before checking again
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        // Writers that batch send what they hold instead of waiting for more.
+        for (const auto& writer : writers_) {
+          writer->idle();
+        }
+        // Buffer is empty, wait for 100ms or until finish() is called before checking again. In
+        // durable mode a new record must not wait that long to start its batch.
+        Clock::duration idle = std::chrono::milliseconds(100);
+        if (commit_log_) {
+          idle = commit_.interval / 4;
+        }
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_.wait_for(lock, idle, [this]() {
+          return finished_.load(std::memory_order_relaxed);
+        });
         continue;
       }
-      for (const auto& writer : writers_) {
-        writer->write(item);
-      }
     }
   }
 
+  // Syncs every writer and marks the records consumed so far as durable.
+  void commit() {
+    bool durable = true;
+    for (const auto& writer : writers_) {
+      durable = writer->sync() && durable;
+    }
+    if (trace_writer_) {
+      durable = trace_writer_->sync() && durable;
+    }
+    ++report_.syncs;
+    if (durable) {
+      report_.synced += consumed_ - committed_;
+    }
+    committed_ = consumed_;
+    batch_end_ = 0;
+    commit_log_->commit(committed_, durable);
+  }
+
   private:
-  std::shared_ptr<RingBuffer<std::string>> buffer_;
+  std::shared_ptr<RingBuffer<LogRecord>> buffer_;
   std::vector<std::unique_ptr<Writer>> writers_;
+  std::unique_ptr<Writer> trace_writer_;
   std::thread process_thread_;
   std::atomic<bool> finished_;
+  // Wakes the process thread up when finish() is called. deadline_ is written before finished_ is
+  // set and only read by the process thread afterwards.
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  Clock::time_point deadline_ = Clock::time_point::max();
+  // Only touched by the process thread until it is joined.
+  ShutdownReport report_;
+  // Set in durable mode, records are then committed in groups as set by commit_.
+  std::shared_ptr<CommitLog> commit_log_;
+  CommitOptions commit_;
+  uint64_t consumed_ = 0;
+  uint64_t committed_ = 0;
+  Clock::time_point batch_start_;
+  // Set once the interval of the batch is up, the batch then ends with the records queued by
+  // then.
+  uint64_t batch_end_ = 0;
+  // When the record consumed last was logged.
+  std::chrono::system_clock::time_point queued_at_;
 };
 
 #endif  // SINK_HPP
@@ -1,10 +1,30 @@
 #ifndef WRITER_HPP
 #define WRITER_HPP
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "formatter.hpp"
+#include "log_index.hpp"
+#include "record.hpp"
 
 namespace fs = std::filesystem;
 
@@ -20,32 +40,90 @@ class Writer {
   // Pure virtual function that must be implemented by derived classes
   virtual void write(const std::string& message) = 0;
 
+  // Writes a record. By default it is rendered in the plain-text format.
+  virtual void write(const LogRecord& record) {
+    line_.clear();
+    formatText(record, line_);
+    writeLine(record, line_);
+    trimLine(line_);
+  }
+
+  // Writes `line`, the rendering of `record`. Writers that keep track of what they wrote
+  // override it, the others just write the line.
+  virtual void writeLine(const LogRecord& /*record*/, const std::string& line) {
+    write(line);
+  }
+
   // Returns the name of the writer
   virtual const std::string name() const = 0;
 
   virtual void flush() = 0;
 
+  // Called by the sink whenever it has drained its queue. Writers that batch send what they hold.
+  virtual void idle() {}
+
+  // Makes everything written so far durable without closing the writer. Returns false if the
+  // writer cannot or the sync failed.
+  virtual bool sync() {
+    return false;
+  }
+
   protected:
+  // Scratch lines are kept for the next record up to this capacity. A larger one is given back
+  // right away, so a single large message does not stay allocated for the life of the writer.
+  static constexpr size_t MAX_LINE_CAPACITY = 64 * KB;
+
+  static void trimLine(std::string& line) {
+    if (line.capacity() > MAX_LINE_CAPACITY) {
+      std::string().swap(line);
+    }
+  }
+
   // Protected constructor to prevent direct instantiation
   Writer() = default;
 
   // Delete copy constructor and assignment operator
   Writer(const Writer&) = delete;
   Writer& operator=(const Writer&) = delete;
+
+  private:
+  // Scratch space for rendering records, reused to avoid an allocation per record.
+  std::string line_;
 };
 
 class FileWriter : public Writer {
   static constexpr size_t BUFFER_SIZE = 20 * MB;
+  // Messages of at least this size are written to the file directly.
+  static constexpr size_t WRITE_THROUGH_SIZE = 1 * MB;
 
   public:
-  FileWriter(const std::string& filename) : filename_(filename) {
+  // With `index_block_size` set, a sidecar index (see log_index.hpp) with an entry about every
+  // `index_block_size` bytes is written to <filename>.idx.
+  FileWriter(const std::string& filename, size_t index_block_size = 0) {
+    if (index_block_size > std::numeric_limits<uint32_t>::max()) {
+      throw std::invalid_argument("Index block size must fit in 32 bits");
+    }
     if (fs::exists(filename)) {
       throw std::runtime_error("File " + filename + " exists");
     }
+    // The index is opened first, so failing to open it leaves no log behind to trip up a retry.
+    // The log is new, whatever an index left at its path says is stale.
+    if (index_block_size > 0) {
+      index_ = std::make_unique<logindex::IndexBuilder>(logindex::indexPath(filename),
+                                                        static_cast<uint32_t>(index_block_size));
+    }
     file_ = std::ofstream(filename, std::ios::out | std::ios::app);
     if (!file_.is_open()) {
       throw std::runtime_error("Cannot open file: " + filename);
     }
+    // The stream does not expose its descriptor. One opened on the file just created syncs the
+    // same data, even once the path is renamed or unlinked.
+    sync_fd_ = ::open(filename.c_str(), O_WRONLY | O_CLOEXEC);
+    if (sync_fd_ < 0) {
+      file_.close();
+      fs::remove(filename);
+      throw std::runtime_error("Cannot open file: " + filename);
+    }
     buffer_.reserve(BUFFER_SIZE);
   }
 
@@ -55,18 +133,83 @@ class FileWriter : public Writer {
       file_.flush();
       file_.close();
     }
+    // Entries are written after the data they point to.
+    if (index_) {
+      index_->finish();
+    }
+    if (sync_fd_ >= 0) {
+      ::close(sync_fd_);
+      sync_fd_ = -1;
+    }
   }
   
   ~FileWriter() {
     flush();
   }
 
+  // Writes the staged buffer in one go and fdatasyncs the file.
+  bool sync() override {
+    if (!file_.is_open()) {
+      return false;
+    }
+    file_ << buffer_;
+    buffer_.clear();
+    file_.flush();
+    if (!file_) {
+      return false;
+    }
+    if (index_) {
+      index_->flush();
+    }
+    return ::fdatasync(sync_fd_) == 0;
+  }
+
   const std::string name() const override {
     return "FileWriter";
   }
 
+  void writeLine(const LogRecord& record, const std::string& line) override {
+    if (index_) {
+      index_->add(written_, line.size(), record.time, record.level);
+    }
+    write(line);
+  }
+
+  using Writer::write;
+
+  void write(const LogRecord& record) override {
+    const std::string_view text = record.text();
+    if (record.kind != RecordKind::LOG || text.size() < WRITE_THROUGH_SIZE) {
+      Writer::write(record);
+      return;
+    }
+    // Only the parts around a large message are rendered, the message itself goes to the file
+    // straight from the record.
+    std::string head;
+    detail::appendTextHeader(record, head);
+    std::string tail;
+    detail::appendTextFields(record, tail);
+    tail += '\n';
+    const size_t size = head.size() + text.size() + tail.size();
+    if (index_) {
+      index_->add(written_, size, record.time, record.level);
+    }
+    written_ += size;
+    file_ << buffer_;
+    buffer_.clear();
+    file_.write(head.data(), head.size());
+    file_.write(text.data(), text.size());
+    file_.write(tail.data(), tail.size());
+  }
+
   void write(const std::string& message) override {
-    if (buffer_.size() + message.size() < BUFFER_SIZE) {
+    written_ += message.size();
+    if (message.size() >= WRITE_THROUGH_SIZE) {
+      // Large messages bypass the staging buffer so it never grows past BUFFER_SIZE.
+      file_ << buffer_;
+      buffer_.clear();
+      file_.write(message.data(), message.size());
+    } else if (buffer_.size() + message.size() < BUFFER_SIZE) {
       buffer_ += message;
     } else {
       file_ << buffer_;
@@ -77,8 +220,11 @@ class FileWriter : public Writer {
 
   private:
   std::ofstream file_;
-  std::string filename_;
   std::string buffer_;
+  int sync_fd_ = -1;
+  // Bytes written so far, the offset of the next record.
+  uint64_t written_ = 0;
+  std::unique_ptr<logindex::IndexBuilder> index_;
 };
 
 class ConsoleWriter : public Writer {
@@ -96,6 +242,16 @@ class ConsoleWriter : public Writer {
 
   void flush() override {}
 
+  // The console is not made durable, it only has to be passed on.
+  bool sync() override {
+    if (writer_type_ == ConsoleType::STD_OUT) {
+      std::cout.flush();
+    }
+    return true;
+  }
+
+  using Writer::write;
+
   void write(const std::string& message) override {
     if (writer_type_ == ConsoleType::STD_OUT) {
       std::cout << message;
@@ -115,11 +271,398 @@ class NoneWriter : public Writer {
 
   void flush() override {}
 
+  bool sync() override {
+    return true;
+  }
+
+  using Writer::write;
+
   void write(const std::string& message) override {
     // Write to /dev/null (no-op)
   }
 };
 
+// Renders records as JSON lines or logfmt and forwards them to another writer.
+class StructuredWriter : public Writer {
+  public:
+  StructuredWriter(std::unique_ptr<Writer> writer, LogFormat format)
+      : writer_(std::move(writer)), format_(format) {
+    if (!writer_) {
+      throw std::invalid_argument("StructuredWriter requires a writer");
+    }
+  }
+
+  const std::string name() const override {
+    return "StructuredWriter";
+  }
+
+  void flush() override {
+    writer_->flush();
+  }
+
+  bool sync() override {
+    return writer_->sync();
+  }
+
+  void idle() override {
+    writer_->idle();
+  }
+
+  // Pre-rendered messages are passed through as they are.
+  void write(const std::string& message) override {
+    writer_->write(message);
+  }
+
+  void write(const LogRecord& record) override {
+    line_.clear();
+    formatRecord(record, format_, line_);
+    writer_->writeLine(record, line_);
+    trimLine(line_);
+  }
+
+  private:
+  std::unique_ptr<Writer> writer_;
+  LogFormat format_;
+  std::string line_;
+};
+
+// Writes spans as Chrome trace events ("X" complete events), viewable in chrome://tracing or
+// Perfetto. Other records are ignored. The file is a valid JSON document once flushed.
+class TraceWriter : public Writer {
+  public:
+  TraceWriter(const std::string& filename)
+      : file_(std::make_unique<FileWriter>(filename)), pid_(static_cast<int64_t>(::getpid())) {
+    file_->write(std::string("{\"traceEvents\":[\n"));
+  }
+
+  ~TraceWriter() {
+    flush();
+  }
+
+  const std::string name() const override {
+    return "TraceWriter";
+  }
+
+  void flush() override {
+    if (!closed_) {
+      file_->write(std::string("\n]}\n"));
+      file_->flush();
+      closed_ = true;
+    }
+  }
+
+  bool sync() override {
+    return !closed_ && file_->sync();
+  }
+
+  // Trace events are only built from records.
+  void write(const std::string& /*message*/) override {}
+
+  void write(const LogRecord& record) override {
+    if (record.kind != RecordKind::SPAN || closed_) {
+      return;
+    }
+    line_.clear();
+    if (!first_) {
+      line_ += ",\n";
+    }
+    first_ = false;
+    line_ += "{\"name\":";
+    detail::appendJsonString(line_, record.span_name);
+    line_ += ",\"ph\":\"X\",\"ts\":";
+    detail::appendNumber(
+        line_,
+        std::chrono::duration_cast<std::chrono::microseconds>(record.time.time_since_epoch())
+            .count());
+    line_ += ",\"dur\":";
+    detail::appendNumber(line_, record.spanMicros());
+    line_ += ",\"pid\":";
+    detail::appendNumber(line_, pid_);
+    line_ += ",\"tid\":";
+    detail::appendNumber(line_, record.thread_id);
+    line_ += '}';
+    file_->write(line_);
+  }
+
+  private:
+  std::unique_ptr<FileWriter> file_;
+  int64_t pid_;
+  bool first_ = true;
+  bool closed_ = false;
+  std::string line_;
+};
+
+enum class DatagramFraming {
+  RAW,      // The rendered line, newline included
+  RFC5424,  // A syslog message: "<PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID - - MSG"
+};
+
+struct DatagramOptions {
+  DatagramFraming framing = DatagramFraming::RFC5424;
+  // Datagrams sent per sendmmsg() call.
+  size_t batch_size = 64;
+  // Longer messages are truncated.
+  size_t max_datagram_size = 8 * KB;
+  // How often a batch is retried while the socket would block, and how long to wait in between,
+  // before the rest of the batch is dropped.
+  int max_retries = 3;
+  std::chrono::microseconds retry_delay{100};
+  std::string app_name = "-";
+  int facility = 1;  // user-level messages
+};
+
+// Sends every record as one datagram to a local syslog daemon or log agent, over a Unix datagram
+// socket ("unix:/dev/log") or UDP ("udp:127.0.0.1:514"). Records are queued and sent in batches
+// with a single sendmmsg() call, once the batch is full or the sink runs out of records. The socket
+// never blocks: a batch the collector cannot take is retried a bounded number of times and then
+// dropped, so a slow collector costs records rather than stalling the sink.
+class DatagramWriter : public Writer {
+  public:
+  DatagramWriter(const std::string& address, const DatagramOptions& options = DatagramOptions())
+      : DatagramWriter(connect(address), options) {}
+
+  // Takes over a connected datagram socket, e.g. one end of a socketpair().
+  DatagramWriter(int fd, const DatagramOptions& options)
+      : fd_(fd),
+        options_(options),
+        messages_(std::max<size_t>(options.batch_size, 1)),
+        headers_(messages_.size()),
+        iovecs_(messages_.size()) {
+    ::fcntl(fd_, F_SETFL, ::fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    char hostname[256];
+    if (::gethostname(hostname, sizeof(hostname)) == 0) {
+      hostname[sizeof(hostname) - 1] = '\0';
+      hostname_ = hostname;
+    }
+    if (hostname_.empty()) {
+      hostname_ = "-";
+    }
+    pid_ = std::to_string(::getpid());
+  }
+
+  ~DatagramWriter() {
+    flush();
+    ::close(fd_);
+  }
+
+  const std::string name() const override {
+    return "DatagramWriter";
+  }
+
+  void flush() override {
+    send();
+  }
+
+  void idle() override {
+    send();
+  }
+
+  // A datagram handed to the socket is as far as this writer can take a record, so a durable
+  // commit only waits for the batch to be sent.
+  bool sync() override {
+    send();
+    return true;
+  }
+
+  // Messages written without a record are sent as INFO records of the current time.
+  void write(const std::string& message) override {
+    std::string& slot = next();
+    if (options_.framing == DatagramFraming::RFC5424) {
+      appendHeader(slot, LogLevel::INFO, std::chrono::system_clock::now());
+      appendBody(slot, message);
+    } else {
+      slot += message;
+    }
+    queued();
+  }
+
+  void write(const LogRecord& record) override {
+    std::string& slot = next();
+    if (options_.framing == DatagramFraming::RFC5424) {
+      appendHeader(slot, record.level, record.time);
+      formatMessage(record, slot);
+    } else {
+      formatText(record, slot);
+    }
+    queued();
+  }
+
+  // Lines rendered by a StructuredWriter, which become the MSG part in RFC 5424 framing.
+  void writeLine(const LogRecord& record, const std::string& line) override {
+    std::string& slot = next();
+    if (options_.framing == DatagramFraming::RFC5424) {
+      appendHeader(slot, record.level, record.time);
+      appendBody(slot, line);
+    } else {
+      slot += line;
+    }
+    queued();
+  }
+
+  // Datagrams handed to the socket, and dropped because it would block or refused them.
+  size_t sent() const {
+    return sent_;
+  }
+
+  size_t dropped() const {
+    return dropped_;
+  }
+
+  private:
+  static int connect(const std::string& address) {
+    int fd = -1;
+    if (address.rfind("unix:", 0) == 0) {
+      const std::string path = address.substr(5);
+      sockaddr_un addr{};
+      if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw std::invalid_argument("Invalid unix socket path: " + path);
+      }
+      addr.sun_family = AF_UNIX;
+      std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+      fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    } else if (address.rfind("udp:", 0) == 0) {
+      const std::string target = address.substr(4);
+      const size_t colon = target.rfind(':');
+      if (colon == std::string::npos) {
+        throw std::invalid_argument("Invalid udp address, expected udp:<host>:<port>: " + address);
+      }
+      std::string host = target.substr(0, colon);
+      if (host.size() > 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+      }
+      addrinfo hints{};
+      hints.ai_socktype = SOCK_DGRAM;
+      addrinfo* result = nullptr;
+      if (::getaddrinfo(host.c_str(), target.c_str() + colon + 1, &hints, &result) != 0) {
+        throw std::runtime_error("Cannot resolve " + address);
+      }
+      for (addrinfo* ai = result; ai != nullptr && fd < 0; ai = ai->ai_next) {
+        fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && ::connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+          ::close(fd);
+          fd = -1;
+        }
+      }
+      ::freeaddrinfo(result);
+    } else {
+      throw std::invalid_argument("Unknown datagram address, expected unix:<path> or "
+                                  "udp:<host>:<port>: " + address);
+    }
+    if (fd < 0) {
+      throw std::runtime_error("Cannot connect to " + address);
+    }
+    return fd;
+  }
+
+  static int severity(LogLevel level) {
+    switch (level) {
+      case LogLevel::DEBUG:
+        return 7;
+      case LogLevel::INFO:
+        return 6;
+      case LogLevel::WARNING:
+        return 4;
+      case LogLevel::ERROR:
+        return 3;
+      case LogLevel::CRITICAL:
+        return 2;
+      default:
+        return 6;
+    }
+  }
+
+  void appendHeader(std::string& out, LogLevel level, std::chrono::system_clock::time_point time) {
+    out += '<';
+    detail::appendNumber(out, options_.facility * 8 + severity(level));
+    out += ">1 ";
+    detail::appendUtcTime(out, time);
+    out += ' ';
+    out += hostname_;
+    out += ' ';
+    out += options_.app_name;
+    out += ' ';
+    out += pid_;
+    out += " - - ";
+  }
+
+  // The message without the newline of a rendered line.
+  static void appendBody(std::string& out, std::string_view line) {
+    if (!line.empty() && line.back() == '\n') {
+      line.remove_suffix(1);
+    }
+    out.append(line.data(), line.size());
+  }
+
+  std::string& next() {
+    std::string& slot = messages_[count_];
+    slot.clear();
+    return slot;
+  }
+
+  void queued() {
+    std::string& slot = messages_[count_];
+    if (slot.size() > options_.max_datagram_size) {
+      slot.resize(options_.max_datagram_size);
+      slot.shrink_to_fit();
+    }
+    if (++count_ == messages_.size()) {
+      send();
+    }
+  }
+
+  // Sends the queued datagrams in as few sendmmsg() calls as the socket allows.
+  void send() {
+    for (size_t i = 0; i < count_; ++i) {
+      iovecs_[i].iov_base = messages_[i].data();
+      iovecs_[i].iov_len = messages_[i].size();
+      headers_[i] = mmsghdr{};
+      headers_[i].msg_hdr.msg_iov = &iovecs_[i];
+      headers_[i].msg_hdr.msg_iovlen = 1;
+    }
+    size_t next = 0;
+    int retries = 0;
+    while (next < count_) {
+      const int n = ::sendmmsg(fd_, &headers_[next], count_ - next, MSG_DONTWAIT);
+      if (n > 0) {
+        next += n;
+        sent_ += n;
+      } else if (n < 0 && errno == EINTR) {
+        continue;
+      } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+        if (retries++ == options_.max_retries) {
+          break;
+        }
+        std::this_thread::sleep_for(options_.retry_delay);
+      } else if (n < 0 && errno == EMSGSIZE) {
+        // Only this datagram is refused.
+        ++next;
+        ++dropped_;
+      } else {
+        // No collector listening or a broken socket, nothing in this batch gets through.
+        break;
+      }
+    }
+    dropped_ += count_ - next;
+    count_ = 0;
+  }
+
+  int fd_;
+  DatagramOptions options_;
+  std::string hostname_;
+  std::string pid_;
+  // The batch, slots keep their storage.
+  std::vector<std::string> messages_;
+  std::vector<mmsghdr> headers_;
+  std::vector<iovec> iovecs_;
+  size_t count_ = 0;
+  size_t sent_ = 0;
+  size_t dropped_ = 0;
+};
+
 class WriterFactory {
   public:
   enum class WriterType {
@@ -127,6 +670,8 @@ class WriterFactory {
     STDOUT,
     STDERR,
     NONE,
+    TRACE,
+    DATAGRAM,
   };
 
   static std::string to_string(const WriterType& type) {
@@ -139,23 +684,51 @@ class WriterFactory {
         return "STDERR";
       case WriterType::NONE:
         return "NONE";
+      case WriterType::TRACE:
+        return "TRACE";
+      case WriterType::DATAGRAM:
+        return "DATAGRAM";
       default:
         throw std::invalid_argument("Unknown writer type");
     }
   }
   static std::unique_ptr<Writer> create_writer(const WriterType& type,
-                                               const std::string& filename = "") {
+                                               const std::string& filename,
+                                               LogFormat format,
+                                               size_t index_block_size = 0) {
+    auto writer = create_writer(type, filename, index_block_size);
+    if (format == LogFormat::TEXT) {
+      return writer;
+    }
+    return std::make_unique<StructuredWriter>(std::move(writer), format);
+  }
+
+  // `index_block_size` only applies to file writers.
+  static std::unique_ptr<Writer> create_writer(const WriterType& type,
+                                               const std::string& filename = "",
+                                               size_t index_block_size = 0) {
     if (type == WriterType::FILE) {
       if (filename.empty()) {
         throw std::invalid_argument("Filename required for file writer");
       }
-      return std::make_unique<FileWriter>(filename);
+      return std::make_unique<FileWriter>(filename, index_block_size);
     } else if (type == WriterType::STDOUT) {
       return std::make_unique<ConsoleWriter>(ConsoleWriter::ConsoleType::STD_OUT);
     } else if (type == WriterType::STDERR) {
       return std::make_unique<ConsoleWriter>(ConsoleWriter::ConsoleType::STD_ERROR);
     } else if (type == WriterType::NONE) {
       return std::make_unique<NoneWriter>();
+    } else if (type == WriterType::TRACE) {
+      if (filename.empty()) {
+        throw std::invalid_argument("Filename required for trace writer");
+      }
+      return std::make_unique<TraceWriter>(filename);
+    } else if (type == WriterType::DATAGRAM) {
+      // The filename is the address, e.g. unix:/dev/log or udp:127.0.0.1:514.
+      if (filename.empty()) {
+        throw std::invalid_argument("Address required for datagram writer");
+      }
+      return std::make_unique<DatagramWriter>(filename);
     }
     throw std::invalid_argument("Unknown writer type: " + to_string(type));
   }
@@ -1,13 +1,48 @@
 #include "benchmark.hpp"
 
 #include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 
 #include "logger.hpp"
 
-int main() {
+int main(int argc, char** argv) {
+  // Usage: benchmark [text|json|logfmt] [mixed|durable [interval_us]]
+  // The output format defaults to text. "mixed" makes every 1000th message 1 MB instead of
+  // 100 bytes to exercise the large message path. "durable" measures group commits with the
+  // given commit interval, 2000 us by default.
+  LogFormat format = LogFormat::TEXT;
+  if (argc > 1 && std::strcmp(argv[1], "json") == 0) {
+    format = LogFormat::JSON;
+  } else if (argc > 1 && std::strcmp(argv[1], "logfmt") == 0) {
+    format = LogFormat::LOGFMT;
+  }
+  LoggerOptions options;
+  options.format = format;
+  if (argc > 2 && std::strcmp(argv[2], "durable") == 0) {
+    options.commit.durable = true;
+    if (argc > 3) {
+      options.commit.interval = std::chrono::microseconds(std::atoll(argv[3]));
+    }
+    Logger::getInstance().init("app.log", LogLevel::INFO, false, options);
+    Benchmark benchmark(20, 100, 1000);
+    benchmark.runDurable();
+    auto report = Logger::getInstance().shutdown();
+    if (report.syncs > 0) {
+      std::cout << "Records per sync: "
+                << static_cast<double>(report.synced) / static_cast<double>(report.syncs) << " ("
+                << report.syncs << " syncs)" << std::endl;
+    }
+    return 0;
+  }
   // Initialize the logger
-  Logger::getInstance().init("app.log", LogLevel::INFO, false);
+  Logger::getInstance().init("app.log", LogLevel::INFO, false, options);
+  if (argc > 2 && std::strcmp(argv[2], "mixed") == 0) {
+    Benchmark benchmark(20, 100, 100000, MB, 1000);
+    benchmark.run();
+    return 0;
+  }
   Benchmark benchmark(
       20, 1000, 100000);  // 4 threads, 20 bytes per message, 1000 messages per thread
   benchmark.run();
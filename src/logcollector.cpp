@@ -0,0 +1,195 @@
+// Drains the shared memory segment written by processes that called Logger::initShared() and
+// writes their records with the regular writers, so those processes never format or do I/O.
+//
+// Usage: logcollector <segment> [--file <path>] [--stdout] [--datagram <address>]
+//                     [--format text|json|logfmt] [--once]
+//
+// --datagram forwards records as RFC 5424 syslog messages to unix:<path> or udp:<host>:<port>.
+// Without --file or --datagram, records go to stdout. --once drains what is there and exits,
+// otherwise the collector runs until SIGINT or SIGTERM.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "record.hpp"
+#include "shm_ring_buffer.hpp"
+#include "writer.hpp"
+
+namespace {
+
+std::atomic<bool> g_stop{false};
+
+void handleSignal(int) {
+  g_stop.store(true);
+}
+
+class Collector {
+  public:
+  Collector(std::unique_ptr<shm::Segment> segment, std::vector<std::unique_ptr<Writer>> writers)
+      : segment_(std::move(segment)), writers_(std::move(writers)) {}
+
+  // Drains every region once and returns the number of records written.
+  size_t collect() {
+    size_t collected = 0;
+    for (uint32_t r = 0; r < segment_->regionCount(); ++r) {
+      shm::Region region = segment_->region(r);
+      const int32_t owner = region.owner();
+      collected += drain(region);
+      // The region may have been released and claimed again since `owner` was read, only take
+      // it over if it still belongs to the dead producer.
+      if (shm::Segment::ownerDead(owner) && region.reclaim(owner)) {
+        // The producer crashed. Skip what it never finished writing and free the region.
+        while (region.skipAbandoned() > 0) {
+          collected += drain(region);
+        }
+        region.release(shm::RECOVERING);
+      }
+    }
+    return collected;
+  }
+
+  void flush() {
+    for (const auto& writer : writers_) {
+      writer->flush();
+    }
+  }
+
+  // Lets batching writers send what they hold while there is nothing to collect.
+  void idle() {
+    for (const auto& writer : writers_) {
+      writer->idle();
+    }
+  }
+
+  private:
+  size_t drain(shm::Region& region) {
+    size_t collected = 0;
+    while (region.consume([this](const shm::Record& record) { write(record); }, scratch_)) {
+      ++collected;
+    }
+    return collected;
+  }
+
+  void write(const shm::Record& in) {
+    using std::chrono::nanoseconds;
+    using std::chrono::system_clock;
+    record_.time = system_clock::time_point(
+        std::chrono::duration_cast<system_clock::duration>(nanoseconds(in.time_ns)));
+    record_.level = static_cast<LogLevel>(in.level);
+    record_.thread_id = in.thread_id;
+    if (in.kind == shm::SlotKind::SPAN) {
+      record_.kind = RecordKind::SPAN;
+      span_name_.assign(in.payload.data(), in.payload.size());
+      record_.span_name = span_name_;
+      record_.span_end = system_clock::time_point(
+          std::chrono::duration_cast<system_clock::duration>(nanoseconds(in.end_ns)));
+      record_.message.clear();
+      record_.fields.clear();
+    } else {
+      record_.kind = RecordKind::LOG;
+      record_.fields.clear();
+      const std::string_view message = fields_.decode(in.payload, in.field_count, record_.fields);
+      record_.message.assign(message.data(), message.size());
+    }
+    for (const auto& writer : writers_) {
+      writer->write(record_);
+    }
+  }
+
+  std::unique_ptr<shm::Segment> segment_;
+  std::vector<std::unique_ptr<Writer>> writers_;
+  LogRecord record_;
+  shm::FieldDecoder fields_;
+  std::string span_name_;
+  std::string scratch_;
+};
+
+int usage() {
+  std::cerr << "Usage: logcollector <segment> [--file <path>] [--stdout] [--datagram <address>] "
+               "[--format text|json|logfmt] [--once]"
+            << std::endl;
+  return 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    return usage();
+  }
+  std::string name = argv[1];
+  std::string filename;
+  std::string datagram_address;
+  bool to_stdout = false;
+  bool once = false;
+  LogFormat format = LogFormat::TEXT;
+  for (int i = 2; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--file") == 0 && i + 1 < argc) {
+      filename = argv[++i];
+    } else if (std::strcmp(argv[i], "--datagram") == 0 && i + 1 < argc) {
+      datagram_address = argv[++i];
+    } else if (std::strcmp(argv[i], "--stdout") == 0) {
+      to_stdout = true;
+    } else if (std::strcmp(argv[i], "--once") == 0) {
+      once = true;
+    } else if (std::strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      std::string value = argv[++i];
+      if (value == "json") {
+        format = LogFormat::JSON;
+      } else if (value == "logfmt") {
+        format = LogFormat::LOGFMT;
+      } else if (value != "text") {
+        return usage();
+      }
+    } else {
+      return usage();
+    }
+  }
+
+  std::signal(SIGINT, handleSignal);
+  std::signal(SIGTERM, handleSignal);
+
+  try {
+    std::vector<std::unique_ptr<Writer>> writers;
+    if (!filename.empty()) {
+      writers.push_back(
+          WriterFactory::create_writer(WriterFactory::WriterType::FILE, filename, format));
+    }
+    if (!datagram_address.empty()) {
+      writers.push_back(WriterFactory::create_writer(
+          WriterFactory::WriterType::DATAGRAM, datagram_address, format));
+    }
+    if (to_stdout || (filename.empty() && datagram_address.empty())) {
+      writers.push_back(
+          WriterFactory::create_writer(WriterFactory::WriterType::STDOUT, "", format));
+    }
+    // Create the segment if no producer has yet, so the collector can be started first.
+    Collector collector(shm::Segment::open(name), std::move(writers));
+    size_t total = 0;
+    while (true) {
+      size_t collected = collector.collect();
+      total += collected;
+      if (g_stop.load() || (once && collected == 0)) {
+        break;
+      }
+      if (collected == 0) {
+        collector.idle();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+    }
+    collector.flush();
+    std::cerr << "logcollector: collected " << total << " records" << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << "logcollector: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
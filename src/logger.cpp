@@ -1,76 +1,320 @@
 #include "logger.hpp"
 
+#include <algorithm>
 #include <filesystem>
 #include <stdexcept>
 
-Logger::Logger() : minLogLevel(LogLevel::INFO), consoleOutput(true) {}
+namespace {
+
+// The last record the thread queued in durable mode, by its position in the queue.
+struct PendingCommit {
+  uint64_t generation = 0;
+  uint64_t position = 0;
+  // A record was dropped since the last ticket.
+  bool lost = false;
+};
+
+thread_local PendingCommit pendingCommit;
+
+void trackCommit(const CommitLog& log, bool queued, uint64_t position) {
+  if (pendingCommit.generation != log.generation()) {
+    pendingCommit = PendingCommit{log.generation(), 0, false};
+  }
+  if (queued) {
+    pendingCommit.position = position;
+  } else {
+    pendingCommit.lost = true;
+  }
+}
+
+}  // namespace
+
+Logger::Logger()
+    : minLogLevel(LogLevel::INFO),
+      consoleOutput(true),
+      minCaptureLevel(LogLevel::INFO),
+      flightRecorderLevel(LogLevel::DEBUG),
+      flightRecorderAllThreads(false),
+      messagePool(MessagePool::create()),
+      dropped(0) {}
 
 Logger::~Logger() {
   // Notify the witer to finish.
-  sink->finish();
+  shutdown();
 }
 
 void Logger::finish() {
-  sink->finish();
+  shutdown();
 }
 
-void Logger::init(const std::string& filename, LogLevel level, bool console, bool override) {
-  minLogLevel = level;
-  consoleOutput = console;
+ShutdownReport Logger::shutdown(std::chrono::milliseconds timeout) {
+  std::lock_guard<std::mutex> lifecycle(lifecycleMutex);
+  size_t dropped_count = 0;
+  std::unique_ptr<shm::Producer> old_shared;
+  {
+    std::unique_lock<std::shared_mutex> lock(pipelineMutex);
+    buffer.reset();
+    commitLog.reset();
+    old_shared = std::move(shared);
+    dropped_count = dropped.exchange(0);
+  }
+  if (old_shared) {
+    // Everything already sits in shared memory, the collector takes it from here.
+    ShutdownReport report;
+    report.dropped = dropped_count;
+    return report;
+  }
+  if (!sink) {
+    return {};
+  }
+  auto deadline = Sink::Clock::time_point::max();
+  if (timeout != std::chrono::milliseconds::max()) {
+    deadline = Sink::Clock::now() + timeout;
+  }
+  ShutdownReport report = sink->finish(deadline);
+  sink.reset();
+  report.dropped = dropped_count;
+  return report;
+}
 
-  // Initialize the buffer using the default capacity which is 2000.
-  buffer = std::make_shared<RingBuffer<std::string>>();
+void Logger::init(const std::string& filename,
+                  LogLevel level,
+                  bool console,
+                  const LoggerOptions& options) {
+  std::lock_guard<std::mutex> lifecycle(lifecycleMutex);
   std::vector<WriterFactory::WriterType> writer_types;
-
-  // Initialize the sink which will write to the console and/or a file.
   if (console) {
     writer_types.push_back(WriterFactory::WriterType::STDOUT);
   }
   if (!filename.empty()) {
     writer_types.push_back(WriterFactory::WriterType::FILE);
   }
-  sink = std::make_unique<Sink>(buffer, writer_types, filename);
+  if (!options.datagramAddress.empty()) {
+    writer_types.push_back(WriterFactory::WriterType::DATAGRAM);
+  }
+  // Open the writers before anything is swapped, so a failure leaves the current setup in place.
+  auto writers = Sink::createWriters(writer_types,
+                                     filename,
+                                     options.format,
+                                     options.indexBlockSize,
+                                     options.datagramAddress);
+  auto traceWriter = Sink::createTraceWriter(options.traceFilename);
+
+  minLogLevel.store(level, std::memory_order_relaxed);
+  updateCaptureLevel();
+  consoleOutput = console;
+
+  // Initialize the buffer using the default capacity which is 2000.
+  auto next = std::make_shared<RingBuffer<LogRecord>>();
+  std::shared_ptr<CommitLog> nextCommitLog;
+  if (options.commit.durable) {
+    nextCommitLog = std::make_shared<CommitLog>(options.commit);
+  }
+  std::unique_ptr<shm::Producer> old_shared;
+  {
+    std::unique_lock<std::shared_mutex> lock(pipelineMutex);
+    buffer = next;
+    commitLog = nextCommitLog;
+    old_shared = std::move(shared);
+    dropped.store(0, std::memory_order_relaxed);
+  }
+  // Producers already log into the new buffer. Write out what the old one still holds before
+  // the new writers start, so records keep their order.
+  if (sink) {
+    sink->finish();
+    sink.reset();
+  }
+  sink = std::make_unique<Sink>(next, std::move(writers), std::move(traceWriter), nextCommitLog);
+}
+
+void Logger::initShared(const std::string& name, LogLevel level) {
+  std::lock_guard<std::mutex> lifecycle(lifecycleMutex);
+  // Attach before anything is swapped, so a failure leaves the current setup in place.
+  auto producer = std::make_unique<shm::Producer>(name);
+  minLogLevel.store(level, std::memory_order_relaxed);
+  updateCaptureLevel();
+  std::unique_ptr<shm::Producer> old_shared;
+  {
+    std::unique_lock<std::shared_mutex> lock(pipelineMutex);
+    buffer.reset();
+    commitLog.reset();
+    old_shared = std::move(shared);
+    shared = std::move(producer);
+    dropped.store(0, std::memory_order_relaxed);
+  }
+  if (sink) {
+    sink->finish();
+    sink.reset();
+  }
+}
+
+void Logger::_log(LogLevel level,
+                  std::string_view message,
+                  std::vector<Field> fields,
+                  MessageStream* source) {
+  if (level < minCaptureLevel.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Only capture the time here, the sink renders the record into the configured format.
+  auto time = std::chrono::system_clock::now();
+  if (level < minLogLevel.load(std::memory_order_relaxed)) {
+    flightRecorder.record(level, time, message, std::move(fields));
+    return;
+  }
+  std::shared_lock<std::shared_mutex> lock(pipelineMutex);
+  if (level >= LogLevel::ERROR && flightRecorder.enabled()) {
+    dumpFlightRecorderLocked(flightRecorderAllThreads.load(std::memory_order_relaxed));
+  }
+  produce(level, time, message, std::move(fields), source);
 }
 
-void Logger::_log(LogLevel level, const std::string& message) {
-  if (level < minLogLevel) {
+void Logger::produce(LogLevel level,
+                     std::chrono::system_clock::time_point time,
+                     std::string_view message,
+                     std::vector<Field>&& fields,
+                     MessageStream* source) {
+  if (shared) {
+    if (!produceShared(level, time, message, fields)) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  // Not initialized yet or already shut down.
+  if (!buffer) {
     return;
   }
-  std::string formatted = formatMessage(level, message);
-  buffer->push(formatted);
+  MessagePool::Handle large_message;
+  if (message.size() >= messagePool->threshold()) {
+    // Large messages are parked in the pool so the ring buffer slot only holds a handle. A message
+    // built in a stream is moved there rather than copied.
+    large_message =
+        source ? messagePool->acquire(source->release()) : messagePool->acquire(message);
+    if (!large_message) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      if (commitLog) {
+        trackCommit(*commitLog, false, 0);
+      }
+      return;
+    }
+  }
+  // Write the record straight into the slot so its message storage is reused.
+  uint64_t position = 0;
+  bool pushed = buffer->produce([&](LogRecord& slot, size_t pos) {
+    position = pos + 1;
+    slot.time = time;
+    slot.level = level;
+    slot.kind = RecordKind::LOG;
+    if (large_message) {
+      slot.message.clear();
+    } else {
+      slot.message.assign(message.data(), message.size());
+    }
+    slot.fields = std::move(fields);
+    slot.large_message = std::move(large_message);
+  });
+  if (!pushed) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (commitLog) {
+    trackCommit(*commitLog, pushed, position);
+  }
 }
 
-std::string Logger::getCurrentTime() {
-  auto now = std::chrono::system_clock::now();
-  auto local_time = std::chrono::system_clock::to_time_t(now);
+void Logger::dumpFlightRecorder(bool allThreads) {
+  std::shared_lock<std::shared_mutex> lock(pipelineMutex);
+  dumpFlightRecorderLocked(allThreads);
+}
 
-  std::stringstream ss;
-  ss << std::put_time(std::localtime(&local_time), "%Y-%m-%d %X");
-  return ss.str();
+void Logger::dumpFlightRecorderLocked(bool allThreads) {
+  auto records = flightRecorder.take(allThreads);
+  size_t skip = 0;
+  if (buffer) {
+    // Only the newest records that fit into the queue are written, leaving a slot for the record
+    // that triggered the dump. The others would be refused anyway.
+    const size_t used = buffer->size() + 1;
+    const size_t room = buffer->capacity() > used ? buffer->capacity() - used : 0;
+    if (records.size() > room) {
+      skip = records.size() - room;
+      dropped.fetch_add(skip, std::memory_order_relaxed);
+      if (commitLog) {
+        trackCommit(*commitLog, false, 0);
+      }
+    }
+  }
+  for (size_t i = skip; i < records.size(); ++i) {
+    auto& record = records[i];
+    produce(record.level, record.time, record.message, std::move(record.fields));
+  }
 }
 
-std::string Logger::levelToString(LogLevel level) {
-  switch (level) {
-    case LogLevel::DEBUG:
-      return "DEBUG";
-    case LogLevel::INFO:
-      return "INFO";
-    case LogLevel::WARNING:
-      return "WARNING";
-    case LogLevel::ERROR:
-      return "ERROR";
-    case LogLevel::CRITICAL:
-      return "CRITICAL";
-    default:
-      return "UNKNOWN";
+static int64_t toNanos(std::chrono::system_clock::time_point time) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+bool Logger::produceShared(LogLevel level,
+                           std::chrono::system_clock::time_point time,
+                           std::string_view message,
+                           const std::vector<Field>& fields) {
+  shm::Record record;
+  record.time_ns = toNanos(time);
+  record.thread_id = currentThreadId();
+  record.level = static_cast<uint8_t>(level);
+  record.payload = message;
+  if (!fields.empty()) {
+    // Fields are encoded in front of the message, the collector renders them in its format.
+    thread_local std::string payload;
+    payload.clear();
+    record.field_count = shm::appendFields(payload, fields);
+    payload.append(message.data(), message.size());
+    record.payload = payload;
   }
+  return shared->produce(record);
 }
 
-std::string Logger::formatMessage(LogLevel level, const std::string& message) {
-  std::stringstream ss;
-  ss << "[" << getCurrentTime() << "]"
-     << "[" << levelToString(level) << "] " << message << std::endl;
-  return ss.str();
+void Logger::_span(std::string_view name,
+                   LogLevel level,
+                   std::chrono::system_clock::time_point begin,
+                   std::chrono::system_clock::time_point end) {
+  if (level < minLogLevel.load(std::memory_order_relaxed)) {
+    return;
+  }
+  std::shared_lock<std::shared_mutex> lock(pipelineMutex);
+  if (shared) {
+    shm::Record record;
+    record.time_ns = toNanos(begin);
+    record.end_ns = toNanos(end);
+    record.thread_id = currentThreadId();
+    record.level = static_cast<uint8_t>(level);
+    record.kind = shm::SlotKind::SPAN;
+    record.payload = name;
+    if (!shared->produce(record)) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  if (!buffer) {
+    return;
+  }
+  // A span is a handful of scalars, nothing is formatted on this thread.
+  uint64_t position = 0;
+  bool pushed = buffer->produce([&](LogRecord& slot, size_t pos) {
+    position = pos + 1;
+    slot.time = begin;
+    slot.level = level;
+    slot.kind = RecordKind::SPAN;
+    slot.span_name = name;
+    slot.span_end = end;
+    slot.thread_id = currentThreadId();
+    slot.message.clear();
+    slot.fields.clear();
+    slot.large_message.reset();
+  });
+  if (!pushed) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (commitLog) {
+    trackCommit(*commitLog, pushed, position);
+  }
 }
 
 void Logger::_debug(const std::string& message) {
@@ -94,6 +338,50 @@ void Logger::_critical(const std::string& message) {
 }
 
 void Logger::setLogLevel(LogLevel level) {
-  // TODO: This needs to be thread safe.
-  minLogLevel = level;
+  minLogLevel.store(level, std::memory_order_relaxed);
+  updateCaptureLevel();
+}
+
+CommitTicket Logger::commitTicket() {
+  std::shared_lock<std::shared_mutex> lock(pipelineMutex);
+  if (!commitLog) {
+    return CommitTicket();
+  }
+  if (pendingCommit.generation != commitLog->generation()) {
+    // Nothing queued by this thread yet.
+    return CommitTicket(commitLog, 0);
+  }
+  if (pendingCommit.lost) {
+    pendingCommit.lost = false;
+    return CommitTicket();
+  }
+  return CommitTicket(commitLog, pendingCommit.position);
+}
+
+void Logger::enableFlightRecorder(LogLevel level, size_t depth, bool dumpAllThreads) {
+  if (depth == 0) {
+    throw std::invalid_argument("Flight recorder depth must be greater than 0");
+  }
+  flightRecorderLevel.store(level, std::memory_order_relaxed);
+  flightRecorderAllThreads.store(dumpAllThreads, std::memory_order_relaxed);
+  flightRecorder.enable(depth);
+  updateCaptureLevel();
+}
+
+void Logger::disableFlightRecorder() {
+  flightRecorder.disable();
+  updateCaptureLevel();
+}
+
+MessageStream& Logger::threadStream() {
+  thread_local MessageStream stream;
+  return stream;
+}
+
+void Logger::updateCaptureLevel() {
+  LogLevel level = minLogLevel.load(std::memory_order_relaxed);
+  if (flightRecorder.enabled()) {
+    level = std::min(level, flightRecorderLevel.load(std::memory_order_relaxed));
+  }
+  minCaptureLevel.store(level, std::memory_order_relaxed);
 }
\ No newline at end of file
@@ -0,0 +1,128 @@
+// Prints the lines of a log file that match a time range, a set of levels and a substring. The
+// sidecar index written by FileWriter (<log>.idx) is used to skip the blocks that cannot match;
+// without it the whole file is scanned.
+//
+// Usage: logquery <log> [--from <time>] [--to <time>] [--level <LEVEL>[,<LEVEL>...]]
+//                 [--grep <text>] [--index <path>] [--stats]
+//
+// Times are "YYYY-MM-DD HH:MM:SS" in local time, as in the text format, "YYYY-MM-DDTHH:MM:SS" in
+// UTC, as in the JSON and logfmt formats, or "@<seconds since the epoch>". Both ends are
+// inclusive, to the second.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "log_index.hpp"
+#include "record.hpp"
+
+namespace {
+
+int usage() {
+  std::cerr << "Usage: logquery <log> [--from <time>] [--to <time>] "
+               "[--level <LEVEL>[,<LEVEL>...]] [--grep <text>] [--index <path>] [--stats]"
+            << std::endl;
+  return 2;
+}
+
+bool parseArgTime(std::string_view arg, int64_t& seconds) {
+  if (!arg.empty() && arg.front() == '@') {
+    char* end = nullptr;
+    const std::string digits(arg.substr(1));
+    seconds = std::strtoll(digits.c_str(), &end, 10);
+    return !digits.empty() && *end == '\0';
+  }
+  return arg.size() == 19 && logindex::parseTime(arg, seconds);
+}
+
+bool parseLevels(std::string_view arg, uint32_t& levels) {
+  levels = 0;
+  while (!arg.empty()) {
+    const size_t comma = arg.find(',');
+    const std::string_view name = arg.substr(0, comma);
+    bool found = false;
+    for (auto level : {LogLevel::DEBUG, LogLevel::INFO, LogLevel::WARNING, LogLevel::ERROR,
+                       LogLevel::CRITICAL}) {
+      if (name == levelToString(level)) {
+        levels |= logindex::levelBit(level);
+        found = true;
+      }
+    }
+    if (!found) {
+      return false;
+    }
+    arg = comma == std::string_view::npos ? std::string_view() : arg.substr(comma + 1);
+  }
+  return levels != 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    return usage();
+  }
+  const std::string log_path = argv[1];
+  std::string index_path = logindex::indexPath(log_path);
+  bool stats = false;
+  logindex::Query query;
+  for (int i = 2; i < argc; ++i) {
+    int64_t seconds = 0;
+    if (std::strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+      if (!parseArgTime(argv[++i], seconds)) {
+        return usage();
+      }
+      query.from_ns = seconds * 1000000000;
+    } else if (std::strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+      if (!parseArgTime(argv[++i], seconds)) {
+        return usage();
+      }
+      query.to_ns = seconds * 1000000000 + 999999999;
+    } else if (std::strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+      if (!parseLevels(argv[++i], query.levels)) {
+        return usage();
+      }
+    } else if (std::strcmp(argv[i], "--grep") == 0 && i + 1 < argc) {
+      query.needle = argv[++i];
+    } else if (std::strcmp(argv[i], "--index") == 0 && i + 1 < argc) {
+      index_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--stats") == 0) {
+      stats = true;
+    } else {
+      return usage();
+    }
+  }
+
+  try {
+    logindex::MappedFile log(log_path);
+    std::unique_ptr<logindex::IndexReader> index;
+    if (::access(index_path.c_str(), R_OK) == 0) {
+      index = std::make_unique<logindex::IndexReader>(index_path);
+    }
+    static char output[1 << 16];
+    std::setvbuf(stdout, output, _IOFBF, sizeof(output));
+    auto result = logindex::query(
+        log.data(), log.size(), index.get(), query, [](std::string_view line) {
+          std::fwrite(line.data(), 1, line.size(), stdout);
+        });
+    std::fflush(stdout);
+    if (stats) {
+      std::cerr << "logquery: " << result.lines << " lines, scanned " << result.bytes_scanned
+                << " of " << log.size() << " bytes";
+      if (index) {
+        std::cerr << " in " << result.blocks_scanned << " of " << result.blocks << " blocks";
+      } else {
+        std::cerr << " (no index)";
+      }
+      std::cerr << std::endl;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << "logquery: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -5,6 +5,7 @@
 int main() {
   // Initialize the logger
   Logger::getInstance().init("app.log", LogLevel::INFO, true);
+  LOG_SCOPE_TIMER("main");
   LOG_INFO("This is an info message");
   LOG_DEBUG("Debugging information");
   LOG_INFO("This", "is", "an", "info", "message", 1, 2, 3);
@@ -0,0 +1,45 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "commit_log.hpp"
+
+TEST(CommitLogTest, TicketCompletesOnCommit) {
+  auto log = std::make_shared<CommitLog>();
+  CommitTicket ticket(log, 3);
+  EXPECT_FALSE(ticket.waitFor(std::chrono::milliseconds(1)));
+  log->commit(2, true);
+  EXPECT_FALSE(ticket.waitFor(std::chrono::milliseconds(1)));
+  std::thread committer([&log] { log->commit(5, true); });
+  EXPECT_TRUE(ticket.wait());
+  committer.join();
+}
+
+TEST(CommitLogTest, FailedSyncIsSticky) {
+  auto log = std::make_shared<CommitLog>();
+  log->commit(2, true);
+  log->commit(4, false);
+  log->commit(6, true);
+  EXPECT_TRUE(CommitTicket(log, 2).wait());
+  EXPECT_FALSE(CommitTicket(log, 3).wait());
+  EXPECT_FALSE(CommitTicket(log, 6).wait());
+}
+
+TEST(CommitLogTest, CloseReleasesWaiters) {
+  auto log = std::make_shared<CommitLog>();
+  log->commit(1, true);
+  std::thread closer([&log] { log->close(); });
+  EXPECT_FALSE(CommitTicket(log, 2).wait());
+  closer.join();
+  EXPECT_TRUE(CommitTicket(log, 1).wait());
+  // Nothing is committed after close.
+  log->commit(2, true);
+  EXPECT_FALSE(CommitTicket(log, 2).wait());
+}
+
+TEST(CommitLogTest, DefaultTicketIsNeverDurable) {
+  EXPECT_FALSE(CommitTicket().wait());
+  EXPECT_FALSE(CommitTicket().waitFor(std::chrono::seconds(1)));
+}
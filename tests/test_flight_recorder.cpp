@@ -0,0 +1,174 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "flight_recorder.hpp"
+
+namespace {
+
+std::chrono::system_clock::time_point at(int ms) {
+  return std::chrono::system_clock::time_point(std::chrono::milliseconds(ms));
+}
+
+std::vector<std::string> messages(const std::vector<LogRecord>& records) {
+  std::vector<std::string> out;
+  for (const auto& record : records) {
+    out.push_back(record.message);
+  }
+  return out;
+}
+
+}  // namespace
+
+TEST(FlightRecorderTest, DisabledRecordsNothing) {
+  FlightRecorder recorder;
+  EXPECT_FALSE(recorder.enabled());
+  recorder.record(LogLevel::DEBUG, at(1), "a", {});
+  EXPECT_TRUE(recorder.take(false).empty());
+}
+
+TEST(FlightRecorderTest, KeepsTheMostRecentRecords) {
+  FlightRecorder recorder;
+  recorder.enable(3);
+  for (int i = 0; i < 5; ++i) {
+    recorder.record(LogLevel::DEBUG, at(i), std::to_string(i), {});
+  }
+  EXPECT_EQ(messages(recorder.take(false)), (std::vector<std::string>{"2", "3", "4"}));
+  // Taking empties the buffer.
+  EXPECT_TRUE(recorder.take(false).empty());
+}
+
+TEST(FlightRecorderTest, KeepsFields) {
+  FlightRecorder recorder;
+  recorder.enable();
+  recorder.record(LogLevel::INFO, at(1), "a", {LOG_FIELD("id", 7)});
+  auto records = recorder.take(false);
+  ASSERT_EQ(records.size(), 1);
+  EXPECT_EQ(records[0].level, LogLevel::INFO);
+  ASSERT_EQ(records[0].fields.size(), 1);
+  EXPECT_EQ(std::get<int64_t>(records[0].fields[0].value), 7);
+}
+
+TEST(FlightRecorderTest, TakesAllThreadsInTimestampOrder) {
+  FlightRecorder recorder;
+  recorder.enable();
+  recorder.record(LogLevel::DEBUG, at(2), "main 2", {});
+  std::thread other([&recorder] {
+    recorder.record(LogLevel::DEBUG, at(1), "other 1", {});
+    recorder.record(LogLevel::DEBUG, at(3), "other 3", {});
+  });
+  other.join();
+  recorder.record(LogLevel::DEBUG, at(4), "main 4", {});
+  EXPECT_EQ(messages(recorder.take(true)),
+            (std::vector<std::string>{"other 1", "main 2", "other 3", "main 4"}));
+}
+
+TEST(FlightRecorderTest, TakeOnlySeesTheCallingThread) {
+  FlightRecorder recorder;
+  recorder.enable();
+  std::thread other([&recorder] { recorder.record(LogLevel::DEBUG, at(1), "other", {}); });
+  other.join();
+  recorder.record(LogLevel::DEBUG, at(2), "main", {});
+  EXPECT_EQ(messages(recorder.take(false)), (std::vector<std::string>{"main"}));
+  EXPECT_EQ(messages(recorder.take(true)), (std::vector<std::string>{"other"}));
+}
+
+TEST(FlightRecorderTest, DisableForgetsRecords) {
+  FlightRecorder recorder;
+  recorder.enable();
+  recorder.record(LogLevel::DEBUG, at(1), "a", {});
+  recorder.disable();
+  recorder.enable();
+  EXPECT_TRUE(recorder.take(true).empty());
+}
+
+TEST(FlightRecorderTest, FreesBuffersOfExitedThreads) {
+  FlightRecorder recorder;
+  recorder.enable();
+  std::thread drained([&recorder] {
+    recorder.record(LogLevel::DEBUG, at(1), "drained", {});
+    recorder.take(false);
+  });
+  drained.join();
+  EXPECT_EQ(recorder.threadCount(), 0);
+
+  // A buffer with records is kept for the next dump of all threads.
+  std::thread holding([&recorder] { recorder.record(LogLevel::DEBUG, at(2), "kept", {}); });
+  holding.join();
+  EXPECT_EQ(recorder.threadCount(), 1);
+  EXPECT_EQ(messages(recorder.take(true)), std::vector<std::string>{"kept"});
+  EXPECT_EQ(recorder.threadCount(), 0);
+}
+
+TEST(FlightRecorderTest, KeepsABoundedNumberOfExitedThreads) {
+  FlightRecorder recorder;
+  recorder.enable();
+  const int threads = FlightRecorder::MAX_EXITED_THREADS + 8;
+  for (int i = 0; i < threads; ++i) {
+    std::thread([&recorder, i] {
+      recorder.record(LogLevel::DEBUG, at(i), std::to_string(i), {});
+    }).join();
+  }
+  EXPECT_EQ(recorder.threadCount(), FlightRecorder::MAX_EXITED_THREADS);
+  // The most recently exited threads are the ones kept.
+  auto records = recorder.take(true);
+  ASSERT_EQ(records.size(), FlightRecorder::MAX_EXITED_THREADS);
+  EXPECT_EQ(records.front().message, std::to_string(threads - FlightRecorder::MAX_EXITED_THREADS));
+  EXPECT_EQ(records.back().message, std::to_string(threads - 1));
+}
+
+TEST(FlightRecorderTest, FormatsKeptArgumentsWhenTaken) {
+  static_assert(FlightRecorder::DEFERRABLE<const char (&)[3], int&, double>);
+  static_assert(!FlightRecorder::DEFERRABLE<char (&)[3]>);
+  static_assert(!FlightRecorder::DEFERRABLE<const char*>);
+  static_assert(!FlightRecorder::DEFERRABLE<std::string&>);
+
+  FlightRecorder recorder;
+  recorder.enable(3);
+  int id = 7;
+  recorder.recordArgs(LogLevel::DEBUG, at(1), "id=", id, " took ", 1.5, " ms");
+  id = 8;
+  recorder.record(LogLevel::DEBUG, at(2), "formatted", {LOG_FIELD("id", 9)});
+  recorder.recordArgs(LogLevel::DEBUG, at(3), "flag ", true, ' ', 'c');
+  auto records = recorder.take(false);
+  EXPECT_EQ(messages(records),
+            (std::vector<std::string>{"id=7 took 1.5 ms", "formatted", "flag 1 c"}));
+  EXPECT_EQ(records[1].fields.size(), 1);
+  EXPECT_TRUE(records[2].fields.empty());
+}
+
+TEST(FlightRecorderTest, TakesWhileTheOwnerRecords) {
+  FlightRecorder recorder;
+  recorder.enable(16);
+  std::atomic<bool> done{false};
+  std::thread writer([&] {
+    for (int i = 0; i < 20000; ++i) {
+      if (i % 2) {
+        recorder.recordArgs(LogLevel::DEBUG, at(i), "n", i);
+      } else {
+        recorder.record(LogLevel::DEBUG, at(i), "n" + std::to_string(i), {});
+      }
+    }
+    done = true;
+  });
+  size_t taken = 0;
+  while (!done) {
+    auto records = recorder.take(true);
+    for (size_t i = 1; i < records.size(); ++i) {
+      EXPECT_LT(records[i - 1].time, records[i].time);
+    }
+    for (const auto& record : records) {
+      EXPECT_EQ(record.message, "n" + std::to_string(record.time.time_since_epoch() /
+                                                      std::chrono::milliseconds(1)));
+    }
+    taken += records.size();
+  }
+  writer.join();
+  taken += recorder.take(true).size();
+  EXPECT_GT(taken, 0);
+  EXPECT_LE(taken, 20000);
+}
@@ -0,0 +1,225 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "log_index.hpp"
+
+namespace fs = std::filesystem;
+
+class LogIndexTest : public ::testing::Test {
+  protected:
+  void SetUp() override {
+    test_dir = fs::temp_directory_path() / "log_index_test";
+    fs::create_directories(test_dir);
+  }
+
+  void TearDown() override {
+    fs::remove_all(test_dir);
+  }
+
+  fs::path test_dir;
+};
+
+static std::chrono::system_clock::time_point at(int64_t seconds) {
+  return std::chrono::system_clock::time_point(std::chrono::seconds(seconds));
+}
+
+static int64_t ns(int64_t seconds) {
+  return seconds * 1000000000;
+}
+
+TEST_F(LogIndexTest, BuilderCutsBlocksAtRecordBoundaries) {
+  auto path = (test_dir / "app.log.idx").string();
+  {
+    logindex::IndexBuilder builder(path, 100);
+    builder.add(0, 60, at(10), LogLevel::INFO);
+    builder.add(60, 60, at(12), LogLevel::DEBUG);
+    builder.add(120, 60, at(11), LogLevel::ERROR);
+  }
+  logindex::IndexReader reader(path);
+  EXPECT_EQ(reader.blockSize(), 100);
+  ASSERT_EQ(reader.size(), 2);
+  auto first = reader.entry(0);
+  EXPECT_EQ(first.offset, 0);
+  EXPECT_EQ(first.size, 120);
+  EXPECT_EQ(first.min_time_ns, ns(10));
+  EXPECT_EQ(first.max_time_ns, ns(12));
+  EXPECT_EQ(first.levels,
+            logindex::levelBit(LogLevel::INFO) | logindex::levelBit(LogLevel::DEBUG));
+  EXPECT_EQ(first.records, 2);
+  auto second = reader.entry(1);
+  EXPECT_EQ(second.offset, 120);
+  EXPECT_EQ(second.size, 60);
+  EXPECT_EQ(second.levels, logindex::levelBit(LogLevel::ERROR));
+}
+
+TEST_F(LogIndexTest, BuilderExtendsTheIndexOfAnExistingLog) {
+  auto path = (test_dir / "app.log.idx").string();
+  const std::string log = std::string(99, 'a') + "\n" + std::string(49, 'b') + "\n";
+  {
+    logindex::IndexBuilder builder(path, 100);
+    builder.add(0, 100, at(10), LogLevel::INFO);
+    builder.add(100, 50, at(11), LogLevel::WARNING);
+    // Never made it to the log.
+    builder.add(150, 50, at(12), LogLevel::ERROR);
+  }
+  {
+    logindex::IndexBuilder builder(path, 100, log);
+    builder.add(150, 60, at(13), LogLevel::ERROR);
+  }
+  logindex::IndexReader reader(path);
+  ASSERT_EQ(reader.size(), 2);
+  EXPECT_EQ(reader.entry(0).offset, 0);
+  EXPECT_EQ(reader.entry(0).size, 100);
+  EXPECT_EQ(reader.entry(0).min_time_ns, ns(10));
+  auto second = reader.entry(1);
+  EXPECT_EQ(second.offset, 100);
+  EXPECT_EQ(second.size, 110);
+  EXPECT_EQ(second.records, 2);
+  // The second block ran past the log, so its bytes were indexed again from the log. That line
+  // carries neither time nor level, so the block matches everything.
+  EXPECT_EQ(second.levels, logindex::ALL_LEVELS);
+  EXPECT_EQ(second.min_time_ns, std::numeric_limits<int64_t>::min());
+}
+
+TEST_F(LogIndexTest, BuilderRebuildsTheIndexFromTheLog) {
+  auto path = (test_dir / "app.log.idx").string();
+  {
+    // Another block size, nothing of it is kept.
+    logindex::IndexBuilder builder(path, 10);
+    builder.add(0, 100, at(10), LogLevel::INFO);
+  }
+  const std::string log =
+      "[2024-01-02 03:04:05][INFO] first\n[2024-01-02 03:04:07][ERROR] second\n";
+  int64_t first = 0;
+  int64_t second = 0;
+  ASSERT_TRUE(logindex::parseLineTime("[2024-01-02 03:04:05]", first));
+  ASSERT_TRUE(logindex::parseLineTime("[2024-01-02 03:04:07]", second));
+  logindex::IndexBuilder(path, 1000, log).finish();
+  logindex::IndexReader reader(path);
+  EXPECT_EQ(reader.blockSize(), 1000);
+  ASSERT_EQ(reader.size(), 1);
+  auto entry = reader.entry(0);
+  EXPECT_EQ(entry.offset, 0);
+  EXPECT_EQ(entry.size, log.size());
+  EXPECT_EQ(entry.records, 2);
+  EXPECT_EQ(entry.min_time_ns, ns(first));
+  EXPECT_EQ(entry.max_time_ns, ns(second) + 999999999);
+  EXPECT_EQ(entry.levels,
+            logindex::levelBit(LogLevel::INFO) | logindex::levelBit(LogLevel::ERROR));
+}
+
+TEST_F(LogIndexTest, ReaderRejectsOtherFiles) {
+  auto path = test_dir / "other";
+  std::ofstream(path) << "not an index file at all";
+  EXPECT_THROW(logindex::IndexReader(path.string()), std::runtime_error);
+}
+
+TEST(LogIndexSearchTest, FindSubstringMatchesStringFind) {
+  std::mt19937 rng(42);
+  std::string haystack(4096, 'a');
+  for (auto& c : haystack) {
+    c = static_cast<char>('a' + rng() % 4);
+  }
+  for (size_t length = 1; length < 20; ++length) {
+    for (int round = 0; round < 50; ++round) {
+      std::string needle(length, 'a');
+      for (auto& c : needle) {
+        c = static_cast<char>('a' + rng() % 4);
+      }
+      size_t begin = rng() % 64;
+      std::string_view view(haystack.data() + begin, haystack.size() - begin - rng() % 64);
+      size_t expected = view.find(needle);
+      if (expected == std::string_view::npos) {
+        expected = view.size();
+      }
+      EXPECT_EQ(logindex::findSubstring(view.data(), view.size(), needle), expected);
+    }
+  }
+  EXPECT_EQ(logindex::findSubstring("abc", 3, ""), 0);
+  EXPECT_EQ(logindex::findSubstring("abc", 3, "abcd"), 3);
+}
+
+TEST(LogIndexSearchTest, ParsesLineTimeAndLevel) {
+  int64_t seconds = 0;
+  LogLevel level = LogLevel::DEBUG;
+  EXPECT_TRUE(logindex::parseLineTime("{\"time\":\"1970-01-02T00:00:01.000Z\"}", seconds));
+  EXPECT_EQ(seconds, 86401);
+  EXPECT_TRUE(logindex::parseLineTime("time=1970-01-01T00:01:00.000Z level=INFO", seconds));
+  EXPECT_EQ(seconds, 60);
+  EXPECT_FALSE(logindex::parseLineTime("no time here", seconds));
+  EXPECT_TRUE(logindex::parseLineLevel("[2024-01-01 10:00:00][ERROR] failed", level));
+  EXPECT_EQ(level, LogLevel::ERROR);
+  EXPECT_TRUE(logindex::parseLineLevel("{\"time\":\"x\",\"level\":\"WARNING\"}", level));
+  EXPECT_EQ(level, LogLevel::WARNING);
+  EXPECT_TRUE(logindex::parseLineLevel("time=x level=DEBUG msg=a", level));
+  EXPECT_EQ(level, LogLevel::DEBUG);
+  EXPECT_FALSE(logindex::parseLineLevel("[2024-01-01 10:00:00][NOPE] x", level));
+}
+
+TEST_F(LogIndexTest, QuerySkipsBlocks) {
+  // One logfmt line of 46 or 47 bytes per second, one block per 10 lines. Every 25th line is an
+  // error.
+  std::string log;
+  auto index_path = (test_dir / "app.log.idx").string();
+  {
+    logindex::IndexBuilder builder(index_path, 455);
+    char line[64];
+    for (int i = 0; i < 100; ++i) {
+      LogLevel level = i % 25 == 0 ? LogLevel::ERROR : LogLevel::INFO;
+      int length = std::snprintf(line,
+                                 sizeof(line),
+                                 "time=1970-01-01T00:%02d:%02d.000Z level=%s n=%02d\n",
+                                 i / 60,
+                                 i % 60,
+                                 levelToString(level),
+                                 i);
+      builder.add(log.size(), length, at(i), level);
+      log.append(line, length);
+    }
+  }
+  logindex::IndexReader reader(index_path);
+  ASSERT_EQ(reader.size(), 10);
+
+  auto run = [&](const logindex::Query& query, const logindex::IndexReader* index,
+                 logindex::QueryStats* stats = nullptr) {
+    std::vector<std::string> lines;
+    auto result = logindex::query(log.data(), log.size(), index, query,
+                                  [&lines](std::string_view line) { lines.emplace_back(line); });
+    if (stats != nullptr) {
+      *stats = result;
+    }
+    return lines;
+  };
+
+  logindex::Query range;
+  range.from_ns = ns(42);
+  range.to_ns = ns(44);
+  logindex::QueryStats stats;
+  auto lines = run(range, &reader, &stats);
+  ASSERT_EQ(lines.size(), 3);
+  EXPECT_NE(lines[0].find("n=42\n"), std::string::npos);
+  EXPECT_NE(lines[2].find("n=44\n"), std::string::npos);
+  EXPECT_EQ(stats.blocks_scanned, 1);
+  EXPECT_LT(stats.bytes_scanned, log.size() / 5);
+
+  logindex::Query errors;
+  errors.levels = logindex::levelBit(LogLevel::ERROR);
+  lines = run(errors, &reader, &stats);
+  ASSERT_EQ(lines.size(), 4);
+  EXPECT_NE(lines[1].find("n=25"), std::string::npos);
+  EXPECT_EQ(stats.blocks_scanned, 4);
+
+  logindex::Query grep;
+  grep.needle = "n=7";
+  EXPECT_EQ(run(grep, &reader).size(), 10);
+  // The same answers without the index.
+  EXPECT_EQ(run(range, nullptr).size(), 3);
+  EXPECT_EQ(run(errors, nullptr).size(), 4);
+  EXPECT_EQ(run(grep, nullptr).size(), 10);
+}
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include "logger.hpp"
+#include <cstring>
 #include <fstream>
 #include <filesystem>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <thread>
 #include <vector>
 
@@ -43,4 +46,317 @@ TEST_F(LoggerTest, LogLevels) {
     EXPECT_TRUE(content.find("WARNING") != std::string::npos);
     EXPECT_TRUE(content.find("ERROR") != std::string::npos);
     EXPECT_TRUE(content.find("CRITICAL") != std::string::npos);
-} 
\ No newline at end of file
+} 
+TEST_F(LoggerTest, JsonFields) {
+    auto test_file = test_dir / "apps.json";
+    LoggerOptions options;
+    options.format = LogFormat::JSON;
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false, options);
+    LOG_INFO("user ", "login", LOG_FIELD("user", "alice"), LOG_FIELD("attempt", 2));
+    Logger::getInstance().finish();
+    std::ifstream file(test_file, std::ios::in);
+    std::string content{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    EXPECT_TRUE(content.find("\"level\":\"INFO\"") != std::string::npos);
+    EXPECT_TRUE(content.find("\"message\":\"user login\",\"user\":\"alice\",\"attempt\":2}\n") !=
+                std::string::npos);
+}
+
+static std::string readFile(const fs::path& path) {
+    std::ifstream file(path, std::ios::in);
+    return {std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+}
+
+TEST_F(LoggerTest, ReinitDrainsPreviousSink) {
+    auto first = test_dir / "first.log";
+    auto second = test_dir / "second.log";
+    Logger::getInstance().init(first.string(), LogLevel::INFO, false);
+    LOG_INFO("before reinit");
+    Logger::getInstance().init(second.string(), LogLevel::INFO, false);
+    LOG_INFO("after reinit");
+    Logger::getInstance().finish();
+    EXPECT_TRUE(readFile(first).find("before reinit") != std::string::npos);
+    EXPECT_TRUE(readFile(first).find("after reinit") == std::string::npos);
+    EXPECT_TRUE(readFile(second).find("after reinit") != std::string::npos);
+}
+
+TEST_F(LoggerTest, ShutdownReportsFlushedRecords) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    for (int i = 0; i < 100; ++i) {
+        LOG_INFO("message ", i);
+    }
+    auto report = Logger::getInstance().shutdown();
+    EXPECT_EQ(report.flushed, 100);
+    EXPECT_EQ(report.abandoned, 0);
+    EXPECT_EQ(report.dropped, 0);
+    EXPECT_TRUE(readFile(test_file).find("message 99") != std::string::npos);
+}
+
+TEST_F(LoggerTest, ShutdownWithExpiredDeadline) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    for (int i = 0; i < 1000; ++i) {
+        LOG_INFO("message ", i);
+    }
+    auto report = Logger::getInstance().shutdown(std::chrono::milliseconds(0));
+    // The sink sleeps between polls, so records logged right after init() are still queued.
+    EXPECT_EQ(report.dropped, 0);
+    EXPECT_EQ(report.flushed + report.abandoned, 1000);
+    EXPECT_GT(report.abandoned, 0);
+    size_t lines = 0;
+    for (char c : readFile(test_file)) {
+        lines += c == '\n';
+    }
+    EXPECT_EQ(lines, report.flushed);
+}
+
+TEST_F(LoggerTest, FailedInitKeepsConfiguration) {
+    auto test_file = test_dir / "apps.log";
+    auto existing = test_dir / "existing.log";
+    std::ofstream(existing) << "taken\n";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    EXPECT_THROW(Logger::getInstance().init(existing.string(), LogLevel::DEBUG, false),
+                 std::runtime_error);
+    EXPECT_FALSE(Logger::getInstance().enabled(LogLevel::DEBUG));
+    LOG_INFO("still logging");
+    Logger::getInstance().finish();
+    EXPECT_TRUE(readFile(test_file).find("still logging") != std::string::npos);
+    EXPECT_EQ(readFile(existing), "taken\n");
+}
+
+TEST_F(LoggerTest, UseAfterShutdown) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    Logger::getInstance().shutdown();
+    LOG_ERROR("after shutdown");
+    auto report = Logger::getInstance().shutdown();
+    EXPECT_EQ(report.flushed, 0);
+    EXPECT_EQ(report.abandoned, 0);
+    EXPECT_TRUE(readFile(test_file).find("after shutdown") == std::string::npos);
+}
+
+TEST_F(LoggerTest, ScopeTimerLogsDuration) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    {
+        LOG_SCOPE_TIMER("db.query");
+        LOG_SCOPE_TIMER("db.debug", LogLevel::DEBUG);
+    }
+    Logger::getInstance().finish();
+    auto content = readFile(test_file);
+    EXPECT_TRUE(content.find("[INFO] db.query duration_us=") != std::string::npos);
+    EXPECT_TRUE(content.find("db.debug") == std::string::npos);
+}
+
+TEST_F(LoggerTest, ScopeTimerWritesTraceFile) {
+    auto test_file = test_dir / "apps.log";
+    auto trace_file = test_dir / "trace.json";
+    LoggerOptions options;
+    options.traceFilename = trace_file.string();
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false, options);
+    {
+        ScopeTimer timer("request");
+        LOG_INFO("handling request");
+        timer.stop();
+    }
+    Logger::getInstance().finish();
+    EXPECT_TRUE(readFile(test_file).find("handling request") != std::string::npos);
+    EXPECT_TRUE(readFile(test_file).find("request duration_us") == std::string::npos);
+    auto trace = readFile(trace_file);
+    EXPECT_EQ(trace.rfind("{\"traceEvents\":[\n{\"name\":\"request\",\"ph\":\"X\"", 0), 0);
+    EXPECT_EQ(trace.substr(trace.size() - 4), "\n]}\n");
+}
+
+TEST_F(LoggerTest, SharedMemoryTransport) {
+    std::string name = "/fast_cpp_logger_logger_test_" + std::to_string(::getpid());
+    shm::Segment::unlink(name);
+    Logger::getInstance().initShared(name, LogLevel::INFO);
+    LOG_INFO("to the collector", LOG_FIELD("id", 5));
+    {
+        LOG_SCOPE_TIMER("shared.span");
+    }
+    auto segment = shm::Segment::attach(name);
+    shm::FieldDecoder decoder;
+    std::vector<std::string> payloads;
+    std::vector<Field> fields;
+    std::string scratch;
+    for (uint32_t r = 0; r < segment->regionCount(); ++r) {
+        while (segment->region(r).consume(
+            [&](const shm::Record& record) {
+                payloads.emplace_back(decoder.decode(record.payload, record.field_count, fields));
+            },
+            scratch)) {
+        }
+    }
+    Logger::getInstance().shutdown();
+    shm::Segment::unlink(name);
+    EXPECT_EQ(payloads, (std::vector<std::string>{"to the collector", "shared.span"}));
+    ASSERT_EQ(fields.size(), 1);
+    EXPECT_EQ(fields[0].key.name, "id");
+    EXPECT_EQ(fields[0].value, FieldValue(int64_t{5}));
+}
+
+TEST_F(LoggerTest, DatagramDestination) {
+    auto socket_path = test_dir / "collector.sock";
+    int receiver = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+    ASSERT_GE(receiver, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(::bind(receiver, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    LoggerOptions options;
+    options.datagramAddress = "unix:" + socket_path.string();
+    Logger::getInstance().init("", LogLevel::INFO, false, options);
+    LOG_WARNING("disk ", "full", LOG_FIELD("free", 0));
+    Logger::getInstance().finish();
+    char buffer[1024];
+    ssize_t n = ::recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT);
+    ::close(receiver);
+    ASSERT_GT(n, 0);
+    std::string datagram(buffer, n);
+    // user.warning is priority 12.
+    EXPECT_EQ(datagram.substr(0, 6), "<12>1 ");
+    EXPECT_NE(datagram.find(" - - disk full free=0"), std::string::npos);
+    options.datagramAddress = "tcp:nowhere";
+    EXPECT_THROW(Logger::getInstance().init("", LogLevel::INFO, false, options),
+                 std::invalid_argument);
+}
+
+TEST_F(LoggerTest, FlightRecorderDumpsOnError) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    Logger::getInstance().enableFlightRecorder(LogLevel::DEBUG, 2);
+    LOG_DEBUG("dropped context");
+    LOG_DEBUG("context ", 1);
+    LOG_INFO("logged");
+    LOG_DEBUG("context ", 2);
+    LOG_ERROR("failure");
+    LOG_DEBUG("after failure");
+    Logger::getInstance().disableFlightRecorder();
+    Logger::getInstance().finish();
+    auto content = readFile(test_file);
+    EXPECT_TRUE(content.find("dropped context") == std::string::npos);
+    EXPECT_TRUE(content.find("after failure") == std::string::npos);
+    auto logged = content.find("[INFO] logged");
+    auto first = content.find("[DEBUG] context 1");
+    auto second = content.find("[DEBUG] context 2");
+    auto failure = content.find("[ERROR] failure");
+    ASSERT_NE(failure, std::string::npos);
+    EXPECT_LT(logged, first);
+    EXPECT_LT(first, second);
+    EXPECT_LT(second, failure);
+}
+
+TEST_F(LoggerTest, FlightRecorderDumpIsBoundedByTheQueue) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    // Deeper than the queue, which holds 2000 records.
+    Logger::getInstance().enableFlightRecorder(LogLevel::DEBUG, 3000);
+    for (int i = 0; i < 2500; ++i) {
+        LOG_DEBUG("context ", i);
+    }
+    LOG_ERROR("failure");
+    Logger::getInstance().disableFlightRecorder();
+    auto report = Logger::getInstance().shutdown();
+    auto content = readFile(test_file);
+    size_t lines = 0;
+    for (char c : content) {
+        lines += c == '\n';
+    }
+    EXPECT_GT(report.dropped, 0);
+    EXPECT_EQ(report.dropped + lines, 2501);
+    EXPECT_TRUE(content.find("context 0\n") == std::string::npos);
+    EXPECT_TRUE(content.find("context 2499\n") != std::string::npos);
+    EXPECT_TRUE(content.find("[ERROR] failure") != std::string::npos);
+}
+
+TEST_F(LoggerTest, FlightRecorderExplicitDumpOfAllThreads) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::WARNING, false);
+    Logger::getInstance().enableFlightRecorder(LogLevel::INFO);
+    LOG_DEBUG("below the recorder");
+    std::thread worker([] { LOG_INFO("worker context"); });
+    worker.join();
+    Logger::getInstance().dumpFlightRecorder();
+    Logger::getInstance().disableFlightRecorder();
+    Logger::getInstance().finish();
+    auto content = readFile(test_file);
+    EXPECT_TRUE(content.find("[INFO] worker context") != std::string::npos);
+    EXPECT_TRUE(content.find("below the recorder") == std::string::npos);
+}
+
+TEST_F(LoggerTest, DurableCommitTicket) {
+    auto test_file = test_dir / "apps.log";
+    LoggerOptions options;
+    options.commit.durable = true;
+    options.commit.interval = std::chrono::milliseconds(1);
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false, options);
+    // Nothing queued by this thread yet.
+    EXPECT_TRUE(Logger::getInstance().commitTicket().wait());
+    LOG_INFO("audit ", 1);
+    LOG_INFO("audit ", 2);
+    EXPECT_TRUE(Logger::getInstance().commitTicket().wait());
+    // Synced records are in the file before the logger is shut down.
+    auto content = readFile(test_file);
+    EXPECT_TRUE(content.find("audit 2") != std::string::npos);
+    std::thread worker([] {
+        LOG_INFO("audit from worker");
+        EXPECT_TRUE(Logger::getInstance().commitTicket().wait());
+    });
+    worker.join();
+    auto report = Logger::getInstance().shutdown();
+    EXPECT_GE(report.syncs, 1);
+    EXPECT_EQ(report.synced, 3);
+    EXPECT_FALSE(Logger::getInstance().commitTicket().wait());
+}
+
+TEST_F(LoggerTest, DurableBatchTakesRecordsQueuedDuringItsInterval) {
+    auto test_file = test_dir / "apps.log";
+    LoggerOptions options;
+    options.commit.durable = true;
+    options.commit.interval = std::chrono::milliseconds(100);
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false, options);
+    LOG_INFO("first");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    for (int i = 0; i < 3; ++i) {
+        LOG_INFO("later ", i);
+    }
+    EXPECT_TRUE(Logger::getInstance().commitTicket().wait());
+    auto report = Logger::getInstance().shutdown();
+    // Everything logged within the interval of the first record goes out in one sync.
+    EXPECT_EQ(report.syncs, 1);
+    EXPECT_EQ(report.synced, 4);
+}
+
+TEST_F(LoggerTest, DurableCommitWithDatagramDestination) {
+    auto socket_path = test_dir / "collector.sock";
+    int receiver = ::socket(AF_UNIX, SOCK_DGRAM, 0);
+    ASSERT_GE(receiver, 0);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    ASSERT_EQ(::bind(receiver, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+    LoggerOptions options;
+    options.commit.durable = true;
+    options.commit.interval = std::chrono::milliseconds(1);
+    options.datagramAddress = "unix:" + socket_path.string();
+    Logger::getInstance().init("", LogLevel::INFO, false, options);
+    LOG_INFO("committed");
+    EXPECT_TRUE(Logger::getInstance().commitTicket().wait());
+    // The datagram was sent before the ticket completed.
+    char buffer[1024];
+    ssize_t n = ::recv(receiver, buffer, sizeof(buffer), MSG_DONTWAIT);
+    ASSERT_GT(n, 0);
+    EXPECT_NE(std::string(buffer, n).find("committed"), std::string::npos);
+    auto report = Logger::getInstance().shutdown();
+    ::close(receiver);
+    EXPECT_EQ(report.synced, 1);
+}
+
+TEST_F(LoggerTest, CommitTicketRequiresDurableMode) {
+    auto test_file = test_dir / "apps.log";
+    Logger::getInstance().init(test_file.string(), LogLevel::INFO, false);
+    LOG_INFO("not durable");
+    EXPECT_FALSE(Logger::getInstance().commitTicket().wait());
+    EXPECT_EQ(Logger::getInstance().shutdown().syncs, 0);
+}
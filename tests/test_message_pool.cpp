@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "message_pool.hpp"
+
+TEST(MessagePoolTest, AcquireAndRelease) {
+  auto pool = MessagePool::create(16, 1024, 2);
+  EXPECT_EQ(pool->threshold(), 16);
+  {
+    const std::string message(100, 'a');
+    auto handle = pool->acquire(std::string_view(message));
+    ASSERT_TRUE(handle);
+    EXPECT_EQ(*handle, message);
+    EXPECT_EQ(pool->inUseBytes(), 100);
+    EXPECT_EQ(pool->freeBuffers(), 0);
+  }
+  EXPECT_EQ(pool->inUseBytes(), 0);
+  EXPECT_EQ(pool->freeBuffers(), 1);
+}
+
+TEST(MessagePoolTest, ReusesFreeBuffers) {
+  auto pool = MessagePool::create(16, 1024, 2);
+  const std::string* first = nullptr;
+  {
+    auto handle = pool->acquire(std::string_view(std::string(200, 'a')));
+    first = handle.get();
+  }
+  // A smaller message fits into the buffer released above.
+  const std::string message(50, 'b');
+  auto handle = pool->acquire(std::string_view(message));
+  EXPECT_EQ(handle.get(), first);
+  EXPECT_EQ(*handle, message);
+  EXPECT_EQ(pool->freeBuffers(), 0);
+}
+
+TEST(MessagePoolTest, AdoptsMovedStorage) {
+  auto pool = MessagePool::create(16, 1024, 2);
+  std::string message(300, 'a');
+  const char* data = message.data();
+  auto handle = pool->acquire(std::move(message));
+  ASSERT_TRUE(handle);
+  EXPECT_EQ(handle->data(), data);
+  EXPECT_EQ(pool->inUseBytes(), 300);
+
+  // Over budget the message stays with the caller.
+  std::string rejected(800, 'b');
+  EXPECT_FALSE(pool->acquire(std::move(rejected)));
+  EXPECT_EQ(rejected.size(), 800);
+
+  // Adopted storage is not kept for reuse.
+  handle.reset();
+  EXPECT_EQ(pool->inUseBytes(), 0);
+  EXPECT_EQ(pool->freeBuffers(), 0);
+}
+
+TEST(MessagePoolTest, DropsBuffersAboveMaxFreeCapacity) {
+  auto pool = MessagePool::create(16, 4096, 2, 512);
+  const std::string large(1000, 'a');
+  const std::string small(100, 'b');
+  {
+    auto a = pool->acquire(std::string_view(large));
+    auto b = pool->acquire(std::string_view(small));
+  }
+  ASSERT_EQ(pool->freeBuffers(), 1);
+  auto handle = pool->acquire(std::string_view(small));
+  EXPECT_LE(handle->capacity(), 512);
+}
+
+TEST(MessagePoolTest, DropsOverBudget) {
+  auto pool = MessagePool::create(16, 1024, 2);
+  auto first = pool->acquire(std::string(600, 'a'));
+  ASSERT_TRUE(first);
+  EXPECT_FALSE(pool->acquire(std::string(600, 'b')));
+  first.reset();
+  EXPECT_TRUE(pool->acquire(std::string(600, 'c')));
+}
+
+TEST(MessagePoolTest, KeepsAtMostMaxFree) {
+  auto pool = MessagePool::create(16, 1024, 1);
+  {
+    const std::string message(100, 'a');
+    auto a = pool->acquire(std::string_view(message));
+    auto b = pool->acquire(std::string_view(message));
+  }
+  EXPECT_EQ(pool->freeBuffers(), 1);
+}
+
+TEST(MessagePoolTest, HandleOutlivesPool) {
+  auto pool = MessagePool::create(16, 1024, 1);
+  auto handle = pool->acquire(std::string(100, 'a'));
+  pool.reset();
+  EXPECT_EQ(*handle, std::string(100, 'a'));
+}
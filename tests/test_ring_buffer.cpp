@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "ring_buffer.hpp"
 
@@ -52,8 +55,11 @@ TEST(RingBufferTest, PushAndPopWithTestItem) {
 
 TEST(RingBufferTest, BufferfullAndEmpty) {
   RingBuffer<std::string> buffer(2);
+  EXPECT_EQ(buffer.size(), 0);
   EXPECT_TRUE(buffer.push("1"));
+  EXPECT_EQ(buffer.size(), 1);
   EXPECT_TRUE(buffer.push("2"));
+  EXPECT_EQ(buffer.size(), 2);
   EXPECT_TRUE(buffer.isFull());
   // Should not push as buffer is full
   EXPECT_FALSE(buffer.push("3"));
@@ -61,6 +67,7 @@ TEST(RingBufferTest, BufferfullAndEmpty) {
   EXPECT_EQ(buffer.pop().first, "1");
   EXPECT_EQ(buffer.pop().first, "2");
   EXPECT_TRUE(buffer.isEmpty());
+  EXPECT_EQ(buffer.size(), 0);
   // Should not pop as buffer is empty
   auto [item, success] = buffer.pop();
   EXPECT_FALSE(success);
@@ -74,4 +81,122 @@ TEST(RingBufferTest, Reset) {
   EXPECT_TRUE(buffer.isEmpty());
   EXPECT_FALSE(buffer.isFull());
   EXPECT_EQ(buffer.pop().second, false);
-}
\ No newline at end of file
+}
+
+TEST(RingBufferTest, ConsumeInPlace) {
+  RingBuffer<std::string> buffer(2);
+  EXPECT_TRUE(buffer.push("1"));
+  EXPECT_TRUE(buffer.push("2"));
+  EXPECT_TRUE(buffer.consume([&buffer](std::string& item) {
+    EXPECT_EQ(item, "1");
+    // The slot is only released once the callback returns.
+    EXPECT_TRUE(buffer.isFull());
+    EXPECT_FALSE(buffer.push("3"));
+  }));
+  EXPECT_FALSE(buffer.isFull());
+  EXPECT_TRUE(buffer.push("3"));
+  EXPECT_TRUE(buffer.consume([](std::string& item) { EXPECT_EQ(item, "2"); }));
+  EXPECT_TRUE(buffer.consume([](std::string& item) { EXPECT_EQ(item, "3"); }));
+  EXPECT_FALSE(buffer.consume([](std::string&) { FAIL() << "Buffer should be empty"; }));
+}
+
+TEST(RingBufferTest, ProduceInPlace) {
+  RingBuffer<TestItem> buffer(1);
+  EXPECT_TRUE(buffer.produce([](TestItem& slot) { slot.i_value = 7; }));
+  EXPECT_FALSE(buffer.produce([](TestItem&) { FAIL() << "Buffer should be full"; }));
+  EXPECT_EQ(buffer.pop().first.i_value, 7);
+}
+
+TEST(RingBufferTest, FailedFillIsSkipped) {
+  RingBuffer<std::string> buffer(2);
+  auto fail = [](std::string& slot) {
+    slot = "partial";
+    throw std::runtime_error("fill failed");
+  };
+  EXPECT_THROW(buffer.produce(fail), std::runtime_error);
+  EXPECT_TRUE(buffer.isEmpty());
+  EXPECT_TRUE(buffer.push(std::string("next")));
+  EXPECT_FALSE(buffer.isEmpty());
+  EXPECT_EQ(buffer.pop(), std::make_pair(std::string("next"), true));
+  EXPECT_TRUE(buffer.isEmpty());
+  // Both slots are free again.
+  EXPECT_TRUE(buffer.push(std::string("a")));
+  EXPECT_TRUE(buffer.push(std::string("b")));
+  EXPECT_EQ(buffer.pop().first, "a");
+  EXPECT_EQ(buffer.pop().first, "b");
+}
+
+TEST(RingBufferTest, SlotStorageIsReused) {
+  RingBuffer<std::string> buffer(1);
+  const char* first = nullptr;
+  const char* second = nullptr;
+  EXPECT_TRUE(buffer.push(std::string(100, 'a')));
+  buffer.consume([&first](std::string& item) { first = item.data(); });
+  const std::string message(50, 'b');
+  EXPECT_TRUE(buffer.push(message));
+  buffer.consume([&second](std::string& item) {
+    EXPECT_EQ(item, std::string(50, 'b'));
+    second = item.data();
+  });
+  EXPECT_EQ(first, second);
+}
+
+TEST(RingBufferTest, ConcurrentSingleProducer) {
+  constexpr int count = 100000;
+  RingBuffer<std::string> buffer(16);
+  std::thread producer([&buffer]() {
+    for (int i = 0; i < count; ++i) {
+      while (!buffer.produce([i](std::string& slot) { slot.assign(std::to_string(i)); })) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  int expected = 0;
+  while (expected < count) {
+    bool consumed = buffer.consume([&expected](std::string& item) {
+      EXPECT_EQ(item, std::to_string(expected));
+      ++expected;
+    });
+    if (!consumed) {
+      std::this_thread::yield();
+    }
+  }
+  producer.join();
+  EXPECT_TRUE(buffer.isEmpty());
+}
+
+TEST(RingBufferTest, ConcurrentMultipleProducers) {
+  constexpr int producers = 4;
+  constexpr int count = 50000;
+  RingBuffer<std::pair<int, int>> buffer(64);
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; ++p) {
+    threads.emplace_back([&buffer, p]() {
+      for (int i = 0; i < count; ++i) {
+        while (!buffer.push({p, i})) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  // Items of each producer arrive in the order they were pushed.
+  std::vector<int> next(producers, 0);
+  int received = 0;
+  while (received < producers * count) {
+    bool consumed = buffer.consume([&](std::pair<int, int>& item) {
+      EXPECT_EQ(item.second, next[item.first]);
+      next[item.first] = item.second + 1;
+      ++received;
+    });
+    if (!consumed) {
+      std::this_thread::yield();
+    }
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_TRUE(buffer.isEmpty());
+  for (int p = 0; p < producers; ++p) {
+    EXPECT_EQ(next[p], count);
+  }
+}
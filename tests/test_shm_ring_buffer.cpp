@@ -0,0 +1,277 @@
+#include <gtest/gtest.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "shm_ring_buffer.hpp"
+
+class ShmRingBufferTest : public ::testing::Test {
+  protected:
+  void SetUp() override {
+    name = "/fast_cpp_logger_test_" + std::to_string(::getpid());
+    shm::Segment::unlink(name);
+    options.regions = 2;
+    options.slots = 16;
+    options.slot_size = 128;
+  }
+
+  void TearDown() override {
+    shm::Segment::unlink(name);
+  }
+
+  static shm::Record makeRecord(std::string_view payload, int64_t time_ns = 1) {
+    shm::Record record;
+    record.time_ns = time_ns;
+    record.level = 2;
+    record.thread_id = 7;
+    record.payload = payload;
+    return record;
+  }
+
+  // Consumes everything published in `region`.
+  static std::vector<std::string> drain(shm::Region region) {
+    std::vector<std::string> payloads;
+    std::string scratch;
+    while (region.consume(
+        [&payloads](const shm::Record& record) { payloads.emplace_back(record.payload); },
+        scratch)) {
+    }
+    return payloads;
+  }
+
+  std::string name;
+  shm::Options options;
+};
+
+TEST_F(ShmRingBufferTest, ProduceAndConsume) {
+  auto segment = shm::Segment::open(name, options);
+  EXPECT_EQ(segment->regionCount(), 2);
+  shm::Region region = segment->region(segment->claimRegion(42));
+  EXPECT_EQ(region.owner(), 42);
+  EXPECT_TRUE(region.produce(makeRecord("hello", 123)));
+
+  std::string scratch;
+  EXPECT_TRUE(region.consume(
+      [](const shm::Record& record) {
+        EXPECT_EQ(record.payload, "hello");
+        EXPECT_EQ(record.time_ns, 123);
+        EXPECT_EQ(record.level, 2);
+        EXPECT_EQ(record.thread_id, 7);
+        EXPECT_EQ(record.kind, shm::SlotKind::LOG);
+      },
+      scratch));
+  EXPECT_FALSE(region.consume([](const shm::Record&) { FAIL(); }, scratch));
+}
+
+TEST_F(ShmRingBufferTest, LongRecordsSpanSlots) {
+  auto segment = shm::Segment::open(name, options);
+  shm::Region region = segment->region(0);
+  std::string payload;
+  for (int i = 0; i < 500; ++i) {
+    payload += static_cast<char>('a' + i % 26);
+  }
+  EXPECT_TRUE(region.produce(makeRecord("short")));
+  EXPECT_TRUE(region.produce(makeRecord(payload)));
+  EXPECT_TRUE(region.produce(makeRecord("after")));
+  EXPECT_EQ(drain(region), (std::vector<std::string>{"short", payload, "after"}));
+}
+
+TEST_F(ShmRingBufferTest, FullRegionRefusesRecords) {
+  auto segment = shm::Segment::open(name, options);
+  shm::Region region = segment->region(0);
+  for (uint32_t i = 0; i < options.slots; ++i) {
+    EXPECT_TRUE(region.produce(makeRecord(std::to_string(i))));
+  }
+  EXPECT_FALSE(region.produce(makeRecord("full")));
+  EXPECT_EQ(drain(region).size(), options.slots);
+  EXPECT_TRUE(region.produce(makeRecord("again")));
+}
+
+TEST_F(ShmRingBufferTest, AttachSharesRecords) {
+  auto producer = std::make_unique<shm::Producer>(name, options);
+  EXPECT_TRUE(producer->produce(makeRecord("shared")));
+  // A second mapping sees the geometry of the existing segment.
+  auto collector = shm::Segment::attach(name);
+  shm::Region region = collector->region(producer->regionIndex());
+  EXPECT_EQ(region.owner(), ::getpid());
+  EXPECT_EQ(drain(region), std::vector<std::string>{"shared"});
+  producer.reset();
+  EXPECT_EQ(region.owner(), 0);
+}
+
+TEST_F(ShmRingBufferTest, RecordsOfCrashedProducerAreKept) {
+  shm::Segment::open(name, options);
+  pid_t child = ::fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    // Exit without releasing the region, as a crash would.
+    auto* producer = new shm::Producer(name);
+    producer->produce(makeRecord("one"));
+    producer->produce(makeRecord("two"));
+    ::_exit(0);
+  }
+  int status = 0;
+  ::waitpid(child, &status, 0);
+
+  auto segment = shm::Segment::attach(name);
+  shm::Region region = segment->region(0);
+  EXPECT_EQ(region.owner(), child);
+  EXPECT_TRUE(shm::Segment::ownerDead(region.owner()));
+  EXPECT_EQ(drain(region), (std::vector<std::string>{"one", "two"}));
+  EXPECT_EQ(region.skipAbandoned(), 0);
+  region.release(child);
+  EXPECT_EQ(region.owner(), 0);
+}
+
+TEST_F(ShmRingBufferTest, SlotClaimedByCrashedProducerIsSkipped) {
+  shm::Segment::open(name, options);
+  pid_t child = ::fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    // One thread claims a slot and dies before publishing it, another publishes after it.
+    auto* producer = new shm::Producer(name);
+    auto segment = shm::Segment::attach(name);
+    shm::Region region = segment->region(producer->regionIndex());
+    producer->produce(makeRecord("before"));
+    uint64_t pos = 0;
+    region.reserve(1, pos);
+    producer->produce(makeRecord("after"));
+    ::_exit(0);
+  }
+  int status = 0;
+  ::waitpid(child, &status, 0);
+
+  // The same steps as logcollector.
+  auto segment = shm::Segment::attach(name);
+  shm::Region region = segment->region(0);
+  ASSERT_TRUE(shm::Segment::ownerDead(region.owner()));
+  EXPECT_EQ(drain(region), std::vector<std::string>{"before"});
+  ASSERT_TRUE(region.reclaim(child));
+  // Nobody can claim the region while it is cleaned up.
+  EXPECT_FALSE(region.claim(::getpid()));
+  EXPECT_EQ(region.skipAbandoned(), 1);
+  EXPECT_EQ(drain(region), std::vector<std::string>{"after"});
+  EXPECT_EQ(region.skipAbandoned(), 0);
+  region.release(shm::RECOVERING);
+  EXPECT_EQ(region.owner(), 0);
+}
+
+TEST_F(ShmRingBufferTest, RegionClaimedAgainIsNotReclaimed) {
+  shm::Segment::open(name, options);
+  pid_t child = ::fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    ::_exit(0);
+  }
+  int status = 0;
+  ::waitpid(child, &status, 0);
+
+  auto segment = shm::Segment::attach(name);
+  shm::Region region = segment->region(0);
+  ASSERT_TRUE(region.claim(child));
+  // The collector reads the owner, then the producer releases the region and a new one claims
+  // it and starts writing a record.
+  const int32_t owner = region.owner();
+  region.release(child);
+  ASSERT_TRUE(region.claim(::getpid()));
+  uint64_t pos = 0;
+  ASSERT_TRUE(region.reserve(1, pos));
+  EXPECT_TRUE(shm::Segment::ownerDead(owner));
+  EXPECT_FALSE(region.reclaim(owner));
+  EXPECT_EQ(region.owner(), ::getpid());
+  // The reserved slot was left alone, so the records behind it still get through.
+  EXPECT_TRUE(region.produce(makeRecord("live")));
+  EXPECT_TRUE(drain(region).empty());
+  EXPECT_FALSE(shm::Segment::ownerDead(shm::RECOVERING));
+}
+
+TEST_F(ShmRingBufferTest, FieldsTravelWithTheRecord) {
+  auto segment = shm::Segment::open(name, options);
+  shm::Region region = segment->region(0);
+  std::vector<Field> fields;
+  fields.push_back(LOG_FIELD("user", "alice"));
+  fields.push_back(LOG_FIELD("attempt", -2));
+  fields.push_back(LOG_FIELD("bytes", 3u));
+  fields.push_back(LOG_FIELD("ratio", 0.5));
+  fields.push_back(LOG_FIELD("ok", true));
+  fields.push_back(LOG_FIELD("a \"key\"", ""));
+  std::string payload;
+  shm::Record record = makeRecord("");
+  record.field_count = shm::appendFields(payload, fields);
+  payload += "login";
+  record.payload = payload;
+  EXPECT_EQ(record.field_count, 6);
+  EXPECT_TRUE(region.produce(record));
+
+  shm::FieldDecoder decoder;
+  std::vector<Field> decoded;
+  std::string message;
+  std::string scratch;
+  ASSERT_TRUE(region.consume(
+      [&](const shm::Record& in) {
+        message = decoder.decode(in.payload, in.field_count, decoded);
+      },
+      scratch));
+  EXPECT_EQ(message, "login");
+  ASSERT_EQ(decoded.size(), fields.size());
+  for (size_t i = 0; i < fields.size(); ++i) {
+    EXPECT_EQ(decoded[i].key.name, fields[i].key.name);
+    EXPECT_EQ(decoded[i].key.json, fields[i].key.json);
+    EXPECT_EQ(decoded[i].key.logfmt, fields[i].key.logfmt);
+    EXPECT_EQ(decoded[i].value, fields[i].value);
+  }
+
+  // A payload cut short keeps its bytes as the message.
+  decoded.clear();
+  const std::string_view truncated(payload.data(), 10);
+  EXPECT_EQ(decoder.decode(truncated, 6, decoded), truncated);
+  EXPECT_TRUE(decoded.empty());
+}
+
+TEST_F(ShmRingBufferTest, ConcurrentProducers) {
+  constexpr int threads = 4;
+  constexpr int count = 2000;
+  options.slots = 64;
+  auto segment = shm::Segment::open(name, options);
+  shm::Region region = segment->region(0);
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threads; ++t) {
+    producers.emplace_back([&region, t]() {
+      for (int i = 0; i < count; ++i) {
+        // Every third record takes several slots.
+        std::string payload = std::to_string(t) + ":" + std::to_string(i);
+        if (i % 3 == 0) {
+          payload += std::string(200, 'x');
+        }
+        while (!region.produce(makeRecord(payload))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  std::vector<int> next(threads, 0);
+  int received = 0;
+  std::string scratch;
+  while (received < threads * count) {
+    bool consumed = region.consume(
+        [&](const shm::Record& record) {
+          auto colon = record.payload.find(':');
+          int t = std::stoi(std::string(record.payload.substr(0, colon)));
+          int i = std::stoi(std::string(record.payload.substr(colon + 1)));
+          EXPECT_EQ(i, next[t]);
+          EXPECT_EQ(record.payload.size() > 200, i % 3 == 0);
+          next[t] = i + 1;
+          ++received;
+        },
+        scratch);
+    if (!consumed) {
+      std::this_thread::yield();
+    }
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+}
@@ -1,8 +1,14 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
+#include <limits>
 #include <sstream>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 #include "writer.hpp"
 
@@ -141,3 +147,365 @@ TEST_F(WriterTest, ConsoleWriterStdErr) {
   std::string output = testing::internal::GetCapturedStderr();
   EXPECT_EQ(output, "Test errorAnother error");
 }
+
+TEST_F(WriterTest, StructuredWriterJson) {
+  auto mock = std::make_unique<MockWriter>();
+  auto* written = &mock->written_messages;
+  StructuredWriter writer(std::move(mock), LogFormat::JSON);
+
+  LogRecord record{std::chrono::system_clock::time_point(std::chrono::milliseconds(1500)),
+                   LogLevel::WARNING,
+                   "say \"hi\"\n",
+                   {}};
+  record.fields.push_back(LOG_FIELD("user", "bob"));
+  record.fields.push_back(LOG_FIELD("count", 3));
+  record.fields.push_back(LOG_FIELD("ok", true));
+  record.fields.push_back(LOG_FIELD("k\"ey", -1.5));
+  writer.write(record);
+
+  ASSERT_EQ(written->size(), 1);
+  EXPECT_EQ((*written)[0],
+            "{\"time\":\"1970-01-01T00:00:01.500Z\",\"level\":\"WARNING\","
+            "\"message\":\"say \\\"hi\\\"\\n\",\"user\":\"bob\",\"count\":3,\"ok\":true,"
+            "\"k\\\"ey\":-1.5}\n");
+}
+
+TEST_F(WriterTest, StructuredWriterLogfmt) {
+  auto mock = std::make_unique<MockWriter>();
+  auto* written = &mock->written_messages;
+  StructuredWriter writer(std::move(mock), LogFormat::LOGFMT);
+
+  LogRecord record{
+      std::chrono::system_clock::time_point(), LogLevel::INFO, "plain", {}};
+  record.fields.push_back(LOG_FIELD("path", "/a b"));
+  record.fields.push_back(LOG_FIELD("my key", 7u));
+  record.fields.push_back(LOG_FIELD("empty", ""));
+  writer.write(record);
+
+  ASSERT_EQ(written->size(), 1);
+  EXPECT_EQ((*written)[0],
+            "time=1970-01-01T00:00:00.000Z level=INFO msg=plain path=\"/a b\" my_key=7 "
+            "empty=\"\"\n");
+}
+
+TEST_F(WriterTest, JsonEscapeLongStrings) {
+  // Place bytes that need escaping on both sides of the 16 byte blocks.
+  std::string value(40, 'x');
+  value[0] = '"';
+  value[15] = '\\';
+  value[16] = '\x01';
+  value[39] = '\t';
+  std::string out;
+  detail::appendEscaped(out, value);
+  EXPECT_EQ(out,
+            "\\\"" + std::string(14, 'x') + "\\\\\\u0001" + std::string(22, 'x') + "\\t");
+
+  // UTF-8 bytes are copied as they are.
+  out.clear();
+  detail::appendEscaped(out, "caf\xc3\xa9 caf\xc3\xa9 caf\xc3\xa9 caf\xc3\xa9");
+  EXPECT_EQ(out, "caf\xc3\xa9 caf\xc3\xa9 caf\xc3\xa9 caf\xc3\xa9");
+}
+
+TEST_F(WriterTest, FileWriterLargeRecordText) {
+  std::string filename = (test_dir / "test.txt").string();
+  auto pool = MessagePool::create();
+  {
+    FileWriter writer(filename);
+    LogRecord record{std::chrono::system_clock::now(), LogLevel::INFO, {}, {}};
+    record.large_message = pool->acquire(std::string(2 * MB, 'a'));
+    writer.write(record);
+    record.large_message.reset();
+    record.message = "small";
+    writer.write(record);
+  }
+  std::ifstream file(filename, std::ios::in);
+  std::string line;
+  std::vector<std::string> lines;
+  while (std::getline(file, line)) {
+    lines.push_back(line);
+  }
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_EQ(lines[0].substr(lines[0].size() - 2 * MB), std::string(2 * MB, 'a'));
+  EXPECT_EQ(lines[1].substr(lines[1].size() - 5), "small");
+  EXPECT_EQ(pool->inUseBytes(), 0);
+}
+
+TEST_F(WriterTest, FileWriterSyncKeepsFileOpen) {
+  std::string filename = (test_dir / "test.txt").string();
+  FileWriter writer(filename);
+  writer.write(std::string("first\n"));
+  EXPECT_TRUE(writer.sync());
+  std::ifstream file(filename, std::ios::in);
+  std::string content{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  EXPECT_EQ(content, "first\n");
+  writer.write(std::string("second\n"));
+  EXPECT_TRUE(writer.sync());
+  writer.flush();
+  EXPECT_FALSE(writer.sync());
+}
+
+TEST_F(WriterTest, FileWriterSyncsRenamedFile) {
+  std::string filename = (test_dir / "test.txt").string();
+  std::string rotated = (test_dir / "test.txt.1").string();
+  FileWriter writer(filename);
+  writer.write(std::string("before\n"));
+  fs::rename(filename, rotated);
+  writer.write(std::string("after\n"));
+  EXPECT_TRUE(writer.sync());
+  EXPECT_FALSE(fs::exists(filename));
+  std::ifstream file(rotated, std::ios::in);
+  std::string content{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  EXPECT_EQ(content, "before\nafter\n");
+}
+
+TEST_F(WriterTest, FileWriterWritesIndex) {
+  std::string filename = (test_dir / "test.txt").string();
+  {
+    auto writer = WriterFactory::create_writer(
+        WriterFactory::WriterType::FILE, filename, LogFormat::JSON, 1 * KB);
+    LogRecord record{std::chrono::system_clock::now(), LogLevel::INFO, std::string(300, 'a'), {}};
+    for (int i = 0; i < 10; ++i) {
+      record.level = i == 9 ? LogLevel::ERROR : LogLevel::INFO;
+      writer->write(record);
+    }
+  }
+  logindex::IndexReader index(logindex::indexPath(filename));
+  // About three records per block.
+  ASSERT_EQ(index.size(), 4);
+  uint64_t end = 0;
+  uint32_t records = 0;
+  for (size_t i = 0; i < index.size(); ++i) {
+    auto entry = index.entry(i);
+    EXPECT_EQ(entry.offset, end);
+    end = entry.offset + entry.size;
+    records += entry.records;
+  }
+  EXPECT_EQ(end, fs::file_size(filename));
+  EXPECT_EQ(records, 10);
+  EXPECT_EQ(index.entry(3).levels, logindex::levelBit(LogLevel::ERROR));
+  EXPECT_EQ(index.entry(0).levels, logindex::levelBit(LogLevel::INFO));
+}
+
+TEST_F(WriterTest, FileWriterRejectsOversizedIndexBlocks) {
+  std::string filename = (test_dir / "test.txt").string();
+  const size_t block_size = size_t{std::numeric_limits<uint32_t>::max()} + 1;
+  EXPECT_THROW(FileWriter(filename, block_size), std::invalid_argument);
+  EXPECT_FALSE(fs::exists(filename));
+}
+
+TEST_F(WriterTest, FileWriterIndexFailureLeavesNoLog) {
+  std::string filename = (test_dir / "test.txt").string();
+  // A directory in the way of the index.
+  fs::create_directories(logindex::indexPath(filename));
+  EXPECT_THROW(FileWriter(filename, 1 * KB), std::runtime_error);
+  EXPECT_FALSE(fs::exists(filename));
+  fs::remove(logindex::indexPath(filename));
+  FileWriter writer(filename, 1 * KB);
+  EXPECT_TRUE(fs::exists(filename));
+}
+
+static LogRecord makeSpan(const char* name, int64_t begin_us, int64_t duration_us) {
+  LogRecord record;
+  record.kind = RecordKind::SPAN;
+  record.span_name = name;
+  record.time = std::chrono::system_clock::time_point(std::chrono::microseconds(begin_us));
+  record.span_end = record.time + std::chrono::microseconds(duration_us);
+  record.thread_id = 3;
+  return record;
+}
+
+TEST_F(WriterTest, SpanRecordsAreLoggedWithDuration) {
+  LogRecord record = makeSpan("db.query", 1000000, 1234);
+  std::string out;
+  formatJson(record, out);
+  EXPECT_EQ(out,
+            "{\"time\":\"1970-01-01T00:00:01.000Z\",\"level\":\"INFO\",\"span\":\"db.query\","
+            "\"duration_us\":1234}\n");
+  out.clear();
+  formatLogfmt(record, out);
+  EXPECT_EQ(out, "time=1970-01-01T00:00:01.000Z level=INFO span=db.query duration_us=1234\n");
+  out.clear();
+  formatText(record, out);
+  EXPECT_TRUE(out.find("[INFO] db.query duration_us=1234\n") != std::string::npos);
+}
+
+TEST_F(WriterTest, TraceWriterWritesChromeTraceEvents) {
+  std::string filename = (test_dir / "trace.json").string();
+  {
+    TraceWriter writer(filename);
+    writer.write(makeSpan("a", 10, 5));
+    LogRecord log;
+    log.message = "ignored";
+    writer.write(log);
+    writer.write(makeSpan("b", 20, 7));
+  }
+  std::ifstream file(filename, std::ios::in);
+  std::string content{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+  std::string pid = std::to_string(::getpid());
+  EXPECT_EQ(content,
+            "{\"traceEvents\":[\n"
+            "{\"name\":\"a\",\"ph\":\"X\",\"ts\":10,\"dur\":5,\"pid\":" + pid + ",\"tid\":3},\n"
+            "{\"name\":\"b\",\"ph\":\"X\",\"ts\":20,\"dur\":7,\"pid\":" + pid + ",\"tid\":3}\n"
+            "]}\n");
+}
+
+static std::vector<std::string> receiveAll(int fd) {
+  std::vector<std::string> datagrams;
+  char buffer[64 * KB];
+  while (true) {
+    ssize_t n = ::recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n < 0) {
+      break;
+    }
+    datagrams.emplace_back(buffer, n);
+  }
+  return datagrams;
+}
+
+static LogRecord makeRecord(LogLevel level, const std::string& message) {
+  return LogRecord{std::chrono::system_clock::time_point(std::chrono::seconds(1)), level, message,
+                   {}};
+}
+
+TEST_F(WriterTest, DatagramWriterRawLinesInOrder) {
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+  DatagramOptions options;
+  options.framing = DatagramFraming::RAW;
+  options.batch_size = 8;
+  DatagramWriter writer(fds[0], options);
+  for (int i = 0; i < 20; ++i) {
+    writer.write(makeRecord(LogLevel::INFO, "message " + std::to_string(i)));
+  }
+  // Two full batches are sent, the rest waits for the sink to run out of records.
+  EXPECT_EQ(receiveAll(fds[1]).size(), 16);
+  writer.idle();
+  auto datagrams = receiveAll(fds[1]);
+  ASSERT_EQ(datagrams.size(), 4);
+  EXPECT_EQ(datagrams[0].substr(datagrams[0].find(']') + 1), "[INFO] message 16\n");
+  EXPECT_EQ(writer.sent(), 20);
+  EXPECT_EQ(writer.dropped(), 0);
+  ::close(fds[1]);
+}
+
+TEST_F(WriterTest, DatagramWriterRfc5424Framing) {
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+  DatagramOptions options;
+  options.app_name = "app";
+  options.facility = 16;
+  {
+    DatagramWriter writer(::dup(fds[0]), options);
+    auto record = makeRecord(LogLevel::WARNING, "slow");
+    record.fields.push_back(LOG_FIELD("ms", 250));
+    writer.write(record);
+  }
+  {
+    StructuredWriter json(std::make_unique<DatagramWriter>(fds[0], options), LogFormat::JSON);
+    json.write(makeRecord(LogLevel::ERROR, "failed"));
+  }
+  auto datagrams = receiveAll(fds[1]);
+  ASSERT_EQ(datagrams.size(), 2);
+  char hostname[256] = {};
+  ::gethostname(hostname, sizeof(hostname) - 1);
+  std::string header = "1970-01-01T00:00:01.000Z " + std::string(hostname) + " app " +
+                       std::to_string(::getpid()) + " - - ";
+  // local0 is facility 16, WARNING is severity 4 and ERROR 3.
+  EXPECT_EQ(datagrams[0], "<132>1 " + header + "slow ms=250");
+  EXPECT_EQ(datagrams[1],
+            "<131>1 " + header +
+                "{\"time\":\"1970-01-01T00:00:01.000Z\",\"level\":\"ERROR\",\"message\":"
+                "\"failed\"}");
+  ::close(fds[1]);
+}
+
+TEST_F(WriterTest, DatagramWriterDropsWhenSocketWouldBlock) {
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+  DatagramOptions options;
+  options.framing = DatagramFraming::RAW;
+  options.max_retries = 2;
+  options.retry_delay = std::chrono::microseconds(100);
+  DatagramWriter writer(fds[0], options);
+  // Nobody reads, the socket fills up.
+  for (int i = 0; i < 10000; ++i) {
+    writer.write(makeRecord(LogLevel::INFO, "message " + std::to_string(i)));
+  }
+  writer.flush();
+  EXPECT_GT(writer.dropped(), 0);
+  EXPECT_EQ(writer.sent() + writer.dropped(), 10000);
+  // With the socket still full, a whole batch is given up after the retries instead of waited on.
+  const size_t sent = writer.sent();
+  const size_t dropped = writer.dropped();
+  for (size_t i = 0; i < options.batch_size; ++i) {
+    writer.write(makeRecord(LogLevel::INFO, "more"));
+  }
+  EXPECT_EQ(writer.sent(), sent);
+  EXPECT_EQ(writer.dropped(), dropped + options.batch_size);
+  EXPECT_EQ(receiveAll(fds[1]).size(), writer.sent());
+  ::close(fds[1]);
+}
+
+TEST_F(WriterTest, DatagramWriterThroughputAndOrdering) {
+  int fds[2];
+  ASSERT_EQ(::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds), 0);
+  int buffer_size = 4 * MB;
+  ::setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+  DatagramOptions options;
+  options.framing = DatagramFraming::RAW;
+  options.max_retries = 1000;
+  constexpr int count = 100000;
+  std::vector<int> received;
+  received.reserve(count);
+  std::thread reader([&received, fd = fds[1]]() {
+    char buffer[KB];
+    while (true) {
+      ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+      if (n <= 0 || std::string_view(buffer, n) == "end") {
+        break;
+      }
+      std::string_view line(buffer, n);
+      received.push_back(std::stoi(std::string(line.substr(line.rfind(' ') + 1))));
+    }
+  });
+  {
+    DatagramWriter writer(fds[0], options);
+    for (int i = 0; i < count; ++i) {
+      writer.write(makeRecord(LogLevel::INFO, "message " + std::to_string(i)));
+    }
+    writer.flush();
+    EXPECT_EQ(writer.sent() + writer.dropped(), count);
+    // The reader keeps up, given the retries.
+    EXPECT_LT(writer.dropped(), count / 100);
+    ::send(fds[0], "end", 3, 0);
+  }
+  reader.join();
+  ::close(fds[1]);
+  ASSERT_GT(received.size(), count * 99 / 100);
+  EXPECT_TRUE(std::is_sorted(received.begin(), received.end()));
+  EXPECT_EQ(std::adjacent_find(received.begin(), received.end()), received.end());
+}
+
+TEST_F(WriterTest, DatagramWriterOverUdp) {
+  int receiver = ::socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_GE(receiver, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(::bind(receiver, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)), 0);
+  socklen_t length = sizeof(addr);
+  ASSERT_EQ(::getsockname(receiver, reinterpret_cast<sockaddr*>(&addr), &length), 0);
+  {
+    std::string address = "udp:127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+    auto writer = WriterFactory::create_writer(WriterFactory::WriterType::DATAGRAM, address);
+    writer->write(makeRecord(LogLevel::INFO, "over udp"));
+  }
+  char buffer[KB];
+  ssize_t n = ::recv(receiver, buffer, sizeof(buffer), 0);
+  ASSERT_GT(n, 0);
+  EXPECT_EQ(std::string(buffer, n).substr(0, 4), "<14>");
+  EXPECT_NE(std::string(buffer, n).find(" - - over udp"), std::string::npos);
+  ::close(receiver);
+  EXPECT_THROW(WriterFactory::create_writer(WriterFactory::WriterType::DATAGRAM, "tcp:x"),
+               std::invalid_argument);
+}